@@ -0,0 +1,88 @@
+// Microbenchmark of ray-sphere intersection, the innermost loop of the renderer for sphere scenes,
+// which is dominated by Vector3 arithmetic. It is a standalone program, built together with the
+// renderer sources, e.g.:
+//
+//   cl /O2 /std:c++20 /EHsc /I src benchmarks\SphereIntersection.cpp src\Random.cpp
+//   cl /O2 /std:c++20 /EHsc /arch:AVX2 /DRT_VECTOR3_SIMD /I src benchmarks\SphereIntersection.cpp src\Random.cpp
+//
+// and prints the number of intersection tests per second, for comparison between Vector3 layouts.
+
+#include <iostream>
+#include <chrono>
+
+#include "Common.h"
+#include "Sphere.h"
+
+
+static const char* LayoutName()
+{
+#if defined(RT_VECTOR3_AVX)
+	return "padded (AVX)";
+#elif defined(RT_VECTOR3_PADDED)
+	return "padded (SSE)";
+#else
+	return "scalar";
+#endif
+}
+
+
+int main()
+{
+	constexpr uint32_t sphere_count = 64;
+	constexpr uint32_t ray_count = 1 << 16;
+	constexpr uint32_t repetitions = 20;
+
+	// Random spheres in front of the camera, and rays from the origin towards them, so that about half of them hit.
+	std::vector<Sphere> spheres;
+	spheres.reserve(sphere_count);
+	for (uint32_t i = 0; i < sphere_count; i++)
+	{
+		const Point3 center(Random::GetDouble(-10.0, 10.0), Random::GetDouble(-10.0, 10.0), Random::GetDouble(-30.0, -10.0));
+		spheres.emplace_back(center, Random::GetDouble(0.5, 2.0), nullptr);
+	}
+
+	std::vector<Ray> rays;
+	rays.reserve(ray_count);
+	for (uint32_t i = 0; i < ray_count; i++)
+	{
+		const Vector3 direction(Random::GetDouble(-0.5, 0.5), Random::GetDouble(-0.5, 0.5), -1.0);
+		rays.emplace_back(Point3(0, 0, 0), Vector3::Normalized(direction), 0.0);
+	}
+
+	// Find the closest hit of each ray as a linear scan over all the spheres (the leaves of the BVH do the same),
+	// keeping the fastest of several repetitions to filter out the noise from the rest of the system.
+	double best_seconds = Infinity;
+	uint64_t hit_count = 0;
+
+	for (uint32_t r = 0; r < repetitions; r++)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+
+		hit_count = 0;
+		for (const Ray& ray : rays)
+		{
+			HitRecord hit;
+			double closest = Infinity;
+			bool any_hit = false;
+			for (const Sphere& sphere : spheres)
+			{
+				if (sphere.Hit(ray, 0.001, closest, hit))
+				{
+					closest = hit.t;
+					any_hit = true;
+				}
+			}
+			hit_count += any_hit;
+		}
+
+		const auto end_time = std::chrono::steady_clock::now();
+		best_seconds = std::min(best_seconds, std::chrono::duration<double>(end_time - start_time).count());
+	}
+
+	const double tests = double(ray_count) * sphere_count;
+	std::cout << "Vector3 layout: " << LayoutName() << " (" << sizeof(Vector3) << " bytes)\n"
+		<< "Rays hitting a sphere: " << hit_count << '/' << ray_count << '\n'
+		<< "Intersection tests: " << (tests / best_seconds / 1e6) << " M/s\n";
+
+	return 0;
+}
@@ -36,6 +36,30 @@ public:
     }
 
 
+    Point3 Center() const noexcept
+    {
+        return Point3(0.5 * (min.x() + max.x()), 0.5 * (min.y() + max.y()), 0.5 * (min.z() + max.z()));
+    }
+
+    double SurfaceArea() const noexcept
+    {
+        const Vector3 extent = max - min;
+        return 2.0 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+    }
+
+
+    // An inverted box which leaves any other box unchanged when combined with it.
+    static AABB Empty()
+    {
+        return AABB(Point3( Infinity,  Infinity,  Infinity),
+                    Point3(-Infinity, -Infinity, -Infinity));
+    }
+
+    static AABB Combine(const AABB& a, const Point3& p)
+    {
+        return Combine(a, AABB(p, p));
+    }
+
     static AABB Combine(const AABB& a, const AABB& b)
     {
         const Point3 min = { std::min(a.min.x(), b.min.x()),
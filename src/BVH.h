@@ -1,84 +1,583 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <span>
+#include <cassert>
+
 #include "Common.h"
-#include "Hittable.h"
 #include "AABB.h"
+#include "NodeBVH.h"
+#include "LBVH.h"
+#include "Parallel.h"
 
 
-class NodeBVH : public Hittable
+// Bounding Volume Hierarchy stored as a flat array of nodes in depth-first order:
+// the first child of an interior node immediately follows its parent, while the
+// index of the second child is stored in the node itself. Leaves reference a range
+// of the primitive indices array, so the hierarchy itself is agnostic of the type of
+// primitives and can be shared by anything that can provide their bounding boxes.
+class BVH
 {
 public:
 
-	std::shared_ptr<Hittable> left;
-	std::shared_ptr<Hittable> right;
-	AABB box;
+	static constexpr int c_maxDepth = MaxDepthBVH;		// Size of the traversal stack
+
+private:
+
+	std::vector<NodeBVH>  m_nodes;
+	std::vector<uint32_t> m_primitives;		// Primitive indices, referenced by the leaves
+	double                m_buildCost = 0.0;	// SAH cost of the hierarchy right after it was built
+
+	// Temporal bounds of the nodes, only present when some primitive moves during the shutter interval.
+	std::vector<NodeMotionBVH> m_motion;
+	MotionIntervalBVH          m_motionInterval;
+
+	// Arrays stored outside of the hierarchy (e.g. in a memory mapped cache file), used in place of the ones above
+	// while the storage is alive. They are copied into the hierarchy only if it needs to be modified (e.g. refitted).
+	std::shared_ptr<const void>    m_externalStorage;
+	std::span<const NodeBVH>       m_externalNodes;
+	std::span<const uint32_t>      m_externalPrimitives;
+	std::span<const NodeMotionBVH> m_externalMotion;
 
 public:
 
-	NodeBVH() = default;
+	bool Empty() const noexcept { return GetNodes().empty(); }
+
+	std::span<const NodeBVH>  GetNodes()      const noexcept { return m_externalStorage ? m_externalNodes : std::span<const NodeBVH>(m_nodes); }
+	std::span<const uint32_t> GetPrimitives() const noexcept { return m_externalStorage ? m_externalPrimitives : std::span<const uint32_t>(m_primitives); }
+
+	double GetBuildCost() const noexcept { return m_buildCost; }
+
+	bool HasMotion() const noexcept { return !GetMotion().empty(); }
+
+	std::span<const NodeMotionBVH> GetMotion() const noexcept { return m_externalStorage ? m_externalMotion : std::span<const NodeMotionBVH>(m_motion); }
+	const MotionIntervalBVH& GetMotionInterval() const noexcept { return m_motionInterval; }
 
-	// Build the BVH sub-tree structure for the given objects
-	NodeBVH(const std::vector<std::shared_ptr<Hittable>>& src_objects, size_t start, size_t end, double time_start, double time_end)
+
+	/* Use a hierarchy stored somewhere else (e.g. loaded from a cache file) without copying it.
+		@param storage  Owner of the memory referenced by the arrays, kept alive as long as they are in use.
+	*/
+	void SetExternalStorage(std::shared_ptr<const void> storage, std::span<const NodeBVH> nodes, std::span<const uint32_t> primitives,
+		std::span<const NodeMotionBVH> motion, const MotionIntervalBVH& motion_interval, const double build_cost) noexcept
+	{
+		m_nodes.clear();
+		m_primitives.clear();
+		m_motion.clear();
+
+		m_externalStorage = std::move(storage);
+		m_externalNodes = nodes;
+		m_externalPrimitives = primitives;
+		m_externalMotion = motion;
+		m_motionInterval = motion_interval;
+		m_buildCost = build_cost;
+	}
+
+
+	// Build the hierarchy over a set of primitives, given their bounding boxes.
+	void Build(const std::vector<AABB>& bounds, const BuildOptionsBVH& options = {})
 	{
-		// Create a modifiable array of the source scene objects
-		auto objects = std::vector<std::shared_ptr<Hittable>>(src_objects.begin() + start, src_objects.begin() + end);
+		m_externalStorage.reset();
+		m_nodes.clear();
+		m_motion.clear();
+		m_buildCost = 0.0;
+		m_primitives.resize(bounds.size());
+		for (uint32_t i = 0; i < m_primitives.size(); i++)
+			m_primitives[i] = i;
+
+		if (bounds.empty())
+			return;
+
+		BuildContext context;
+		context.options = options;
+		context.options.max_leaf_size = std::clamp(options.max_leaf_size, 1u, 255u);
 
-		if (objects.size() == 1)
+		if (options.builder == BuilderBVH::LBVH)
 		{
-			left = right = objects[0];
+			MortonBuilder::Build(bounds, context.options, m_nodes, m_primitives);
+			m_buildCost = Cost();
+			return;
 		}
-		else if (objects.size() == 2)
+
+		context.idle_threads = static_cast<int>(std::max(options.thread_count, 1u)) - 1;
+
+		// Cache the bounds and centroids of the primitives, so that the builder
+		// never has to query the primitives themselves again.
+		context.primitives.resize(bounds.size());
+		ParallelFor(0, bounds.size(), options.thread_count, [&](size_t begin, size_t end, uint32_t)
 		{
-			left = objects[0];
-			right = objects[1];
+			for (size_t i = begin; i < end; i++)
+				context.primitives[i] = { bounds[i], bounds[i].Center() };
+		});
+
+		m_nodes.reserve(2 * bounds.size() - 1);
+		BuildRecursive(context, m_nodes, 0, static_cast<uint32_t>(bounds.size()), 0);
+		m_buildCost = Cost();
+	}
+
+
+	// Update the bounds of all the nodes for new primitive bounds (with the same primitives, in the same
+	// order, as the ones the hierarchy was built over), while keeping its topology unchanged.
+	void Refit(const std::vector<AABB>& bounds)
+	{
+		CopyExternalStorage();
+		m_motion.clear();
+		RefitNodes(m_nodes, bounds);
+	}
+
+
+	/* Replace the bounds of the nodes, which cover the whole shutter interval, with a pair of boxes at
+		its open and close times, so that the traversal can test each ray against the box at its own time.
+		This is a lot tighter for fast moving primitives, whose bounds are otherwise stretched along their
+		whole path. Nothing changes (and the traversal stays as fast as before) if no primitive moves.
+		@param start_bounds, end_bounds  Bounds of the primitives at the two times, in the order used to build.
+	*/
+	void SetMotion(const std::vector<AABB>& start_bounds, const std::vector<AABB>& end_bounds,
+		const double t_start, const double t_end)
+	{
+		CopyExternalStorage();
+		m_motion.clear();
+
+		bool moving = false;
+		for (size_t i = 0; i < start_bounds.size() && !moving; i++)
+		{
+			for (int a = 0; a < 3; a++)
+				moving |= start_bounds[i].min[a] != end_bounds[i].min[a] || start_bounds[i].max[a] != end_bounds[i].max[a];
 		}
-		else
+
+		if (!moving || m_nodes.empty() || !(t_end > t_start))
+			return;
+
+		m_motionInterval.start = t_start;
+		m_motionInterval.scale = 1.0 / (t_end - t_start);
+
+		// Compute the boxes at both times bottom-up, exactly like a refit...
+		std::vector<NodeBVH> end_nodes = m_nodes;
+		RefitNodes(m_nodes, start_bounds);
+		RefitNodes(end_nodes, end_bounds);
+
+		// ...then store them as offsets from the ones at shutter open, rounded outwards. Offsets too small
+		// to be represented as normal floats (e.g. between the two closest boxes around a coordinate of 0)
+		// are folded into the box at shutter open instead, since interpolating denormal values is very slow.
+		m_motion.resize(m_nodes.size());
+		for (size_t i = 0; i < m_nodes.size(); i++)
 		{
-			int axis = Random::GetInteger(0, 2);
-			const auto comparator = [axis](const std::shared_ptr<Hittable>& a, const std::shared_ptr<Hittable>& b) -> bool
+			for (int a = 0; a < 3; a++)
 			{
-				AABB box_a;
-				AABB box_b;
+				float& start_min = m_nodes[i].min[a];
+				float& start_max = m_nodes[i].max[a];
+				float offset_min = end_nodes[i].min[a] - start_min;
+				float offset_max = end_nodes[i].max[a] - start_max;
 
-				if (!a->BoundingBox(0, 0, box_a) || !b->BoundingBox(0, 0, box_b))
-					std::cerr << "No bounding box in NodeBVH constructor.\n";
+				if (std::abs(offset_min) < std::numeric_limits<float>::min())
+				{
+					start_min = std::min(start_min, end_nodes[i].min[a]);
+					offset_min = 0.0f;
+				}
+				else if (start_min + offset_min > end_nodes[i].min[a])
+				{
+					offset_min = std::nextafter(offset_min, -std::numeric_limits<float>::infinity());
+				}
 
-				return box_a.min[axis] < box_b.min[axis];
-			};
+				if (std::abs(offset_max) < std::numeric_limits<float>::min())
+				{
+					start_max = std::max(start_max, end_nodes[i].max[a]);
+					offset_max = 0.0f;
+				}
+				else if (start_max + offset_max < end_nodes[i].max[a])
+				{
+					offset_max = std::nextafter(offset_max, std::numeric_limits<float>::infinity());
+				}
 
-			std::sort(objects.begin(), objects.end(), comparator);
+				m_motion[i].min[a] = offset_min;
+				m_motion[i].max[a] = offset_max;
+			}
+		}
+	}
 
-			const size_t mid = objects.size() / 2;
-			left = std::make_shared<NodeBVH>(objects, 0, mid, time_start, time_end);
-			right = std::make_shared<NodeBVH>(objects, mid, objects.size(), time_start, time_end);
+
+	// Expected cost of tracing a ray through the hierarchy according to the Surface Area Heuristic.
+	double Cost() const noexcept
+	{
+		const std::span<const NodeBVH> nodes = GetNodes();
+		if (nodes.empty())
+			return 0.0;
+
+		double cost = 0.0;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			const double area = SurfaceArea(i);
+			cost += nodes[i].IsLeaf() ? IntersectionCostSAH * nodes[i].count * area : TraversalCostSAH * area;
 		}
 
-		AABB box_left, box_right;
+		const double root_area = SurfaceArea(size_t(0));
+		return root_area > 0.0 ? cost / root_area : cost;
+	}
 
-		if (!left->BoundingBox(time_start, time_end, box_left) || !right->BoundingBox(time_start, time_end, box_right))
-			std::cerr << "No bounding box in NodeBVH constructor.\n";
 
-		box = AABB::Combine(box_left, box_right);
+	/* Find the closest intersection between a ray and the primitives in the hierarchy.
+		@param intersect  Callable as bool(uint32_t primitive, double t_min, double& t_max), which
+		                  tests the given primitive and, on a hit, shrinks t_max to the hit distance.
+	*/
+	template <typename IntersectFn>
+	bool Hit(const Ray& ray, const double t_min, double t_max, IntersectFn&& intersect) const noexcept
+	{
+		const std::span<const uint32_t> primitives = GetPrimitives();
+
+		return HitLeaves(ray, t_min, t_max, [&](const uint32_t first, const uint32_t count, const double t_lower, double& t_closest)
+		{
+			bool hit_something = false;
+			for (uint32_t i = first; i < first + count; i++)
+				hit_something |= intersect(primitives[i], t_lower, t_closest);
+			return hit_something;
+		});
 	}
 
 
-	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
-		const noexcept override final
+	/* Same as Hit(), but handing whole leaves to the callback, for primitives that are tested in batches.
+		@param intersect  Callable as bool(uint32_t first, uint32_t count, double t_min, double& t_max), which
+		                  tests the primitives referenced by the entries [first, first + count) of the primitive
+		                  indices array and, on a hit, shrinks t_max to the distance of the closest one.
+	*/
+	template <typename IntersectFn>
+	bool HitLeaves(const Ray& ray, const double t_min, double t_max, IntersectFn&& intersect) const noexcept
 	{
-		if (!box.Hit(ray, t_min, t_max))
+		const std::span<const NodeBVH> nodes = GetNodes();
+		const std::span<const NodeMotionBVH> node_motion = GetMotion();
+
+		if (nodes.empty())
 			return false;
 
-		const bool hit_left = left->Hit(ray, t_min, t_max, hit);
-		const bool hit_right = right->Hit(ray, t_min, hit_left ? hit.t : t_max, hit);
+		// Precompute the data shared by all the ray-box tests.
+		const float origin[3] = { float(ray.origin[0]), float(ray.origin[1]), float(ray.origin[2]) };
+		const float inv_direction[3] = { float(1.0 / ray.direction[0]), float(1.0 / ray.direction[1]), float(1.0 / ray.direction[2]) };
+		const bool  direction_is_negative[3] = { inv_direction[0] < 0.0f, inv_direction[1] < 0.0f, inv_direction[2] < 0.0f };
+		const bool  motion = !node_motion.empty();
+		const float weight = motion ? m_motionInterval.GetWeight(ray.time) : 0.0f;
+
+		uint32_t stack[c_maxDepth];
+		uint32_t stack_size = 0;
+		uint32_t current = 0;
+		bool hit_something = false;
+
+		while (true)
+		{
+			const NodeBVH& node = nodes[current];
+
+			bool hit_node;
+			if (motion)
+			{
+				// Test the box at the time of the ray, interpolated between the shutter open and close ones.
+				NodeBVH moved = node;
+				for (int a = 0; a < 3; a++)
+				{
+					moved.min[a] += node_motion[current].min[a] * weight;
+					moved.max[a] += node_motion[current].max[a] * weight;
+				}
+				hit_node = moved.Hit(origin, inv_direction, float(t_min), float(t_max));
+			}
+			else
+			{
+				hit_node = node.Hit(origin, inv_direction, float(t_min), float(t_max));
+			}
+
+			if (hit_node)
+			{
+				if (node.IsLeaf())
+				{
+					hit_something |= intersect(node.offset, uint32_t(node.count), t_min, t_max);
+				}
+				else
+				{
+					// Visit the child closest to the ray origin first (according to the direction
+					// of the ray along the split axis), so that t_max shrinks as fast as possible.
+					if (direction_is_negative[node.axis])
+					{
+						stack[stack_size++] = current + 1;
+						current = node.offset;
+					}
+					else
+					{
+						stack[stack_size++] = node.offset;
+						current = current + 1;
+					}
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+
+		return hit_something;
+	}
+
+private:
+
+	static constexpr uint32_t c_binCount = 16;			// Number of candidate split planes (+1) per axis
+
+	struct BuildPrimitive
+	{
+		AABB   bounds;
+		Point3 centroid;
+	};
+
+	struct BuildContext
+	{
+		BuildOptionsBVH             options;
+		std::vector<BuildPrimitive> primitives;
+		std::atomic_int             idle_threads{ 0 };		// Threads still available to build sub-trees
+	};
+
+	struct Bin
+	{
+		AABB     bounds = AABB::Empty();
+		uint32_t count = 0;
+	};
+
+
+	// Recursively build the sub-tree for the primitives in [start, end), appending its nodes in depth-first order.
+	// Sub-trees are built concurrently on disjoint ranges of the primitive indices array, each one into its own
+	// array of nodes which is then appended to its parent's, so the result does not depend on the thread count.
+	uint32_t BuildRecursive(BuildContext& context, std::vector<NodeBVH>& nodes, uint32_t start, uint32_t end, int depth)
+	{
+		const uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+
+		AABB box = AABB::Empty();
+		AABB centroid_box = AABB::Empty();
+		for (uint32_t i = start; i < end; i++)
+		{
+			const BuildPrimitive& primitive = context.primitives[m_primitives[i]];
+			box = AABB::Combine(box, primitive.bounds);
+			centroid_box = AABB::Combine(centroid_box, primitive.centroid);
+		}
+
+		nodes[index].SetBounds(box);
+
+		const uint32_t count = end - start;
+		const auto make_leaf = [&]()
+		{
+			assert(count <= MaxLeafCountBVH);
+			nodes[index].offset = start;
+			nodes[index].count = static_cast<uint16_t>(count);
+			return index;
+		};
+
+		// Stop at single primitives, or when the sub-tree would overflow the traversal stack
+		// (the splits above always leave few enough primitives for a leaf by then).
+		if (count == 1 || depth >= c_maxDepth - 1)
+			return make_leaf();
+
+		// Evaluate the Surface Area Heuristic for the planes between the bins of each axis,
+		// and find the split which minimizes the expected cost of tracing a ray through the node.
+		int best_axis = -1;
+		uint32_t best_bin = 0;
+		double best_cost = Infinity;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const double extent = centroid_box.max[axis] - centroid_box.min[axis];
+			if (extent <= 0.0)
+				continue;
+
+			Bin bins[c_binCount];
+			const double scale = c_binCount / extent;
+			for (uint32_t i = start; i < end; i++)
+			{
+				const BuildPrimitive& primitive = context.primitives[m_primitives[i]];
+				const uint32_t b = GetBinIndex(primitive.centroid[axis], centroid_box.min[axis], scale);
+				bins[b].bounds = AABB::Combine(bins[b].bounds, primitive.bounds);
+				bins[b].count++;
+			}
+
+			// Sweep from the right to accumulate the cost contribution of every right side...
+			double right_area[c_binCount];
+			AABB right_box = AABB::Empty();
+			uint32_t right_count = 0;
+			for (uint32_t b = c_binCount - 1; b > 0; b--)
+			{
+				right_box = AABB::Combine(right_box, bins[b].bounds);
+				right_count += bins[b].count;
+				right_area[b] = right_count > 0 ? right_box.SurfaceArea() * right_count : 0.0;
+			}
+
+			// ...then sweep from the left, evaluating the split after each bin.
+			AABB left_box = AABB::Empty();
+			uint32_t left_count = 0;
+			for (uint32_t b = 0; b < c_binCount - 1; b++)
+			{
+				left_box = AABB::Combine(left_box, bins[b].bounds);
+				left_count += bins[b].count;
+
+				if (left_count == 0 || left_count == count)
+					continue;
+
+				const double cost = left_box.SurfaceArea() * left_count + right_area[b + 1];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		uint32_t mid = start;
+
+		if (best_axis < 0)
+		{
+			// All the centroids are in the same spot: nothing to gain by splitting,
+			// unless there are too many primitives for a single leaf.
+			if (count <= context.options.max_leaf_size)
+				return make_leaf();
+
+			mid = start + count / 2;
+			best_axis = 0;
+		}
+		else
+		{
+			const double split_cost = TraversalCostSAH + IntersectionCostSAH * best_cost / box.SurfaceArea();
+			const double leaf_cost = IntersectionCostSAH * count;
+
+			if (count <= context.options.max_leaf_size && leaf_cost <= split_cost)
+				return make_leaf();
+
+			// Partition the primitives on the two sides of the chosen split plane.
+			const double min = centroid_box.min[best_axis];
+			const double scale = c_binCount / (centroid_box.max[best_axis] - min);
+			const auto middle = std::partition(m_primitives.begin() + start, m_primitives.begin() + end,
+				[&](uint32_t i) { return GetBinIndex(context.primitives[i].centroid[best_axis], min, scale) <= best_bin; });
+
+			mid = static_cast<uint32_t>(middle - m_primitives.begin());
+
+			// Close to the depth limit, a side too large for the levels left is split at the median instead.
+			if (std::max(mid - start, end - mid) > MaxSubtreeCountBVH(depth + 1))
+			{
+				mid = start + count / 2;
+				std::nth_element(m_primitives.begin() + start, m_primitives.begin() + mid, m_primitives.begin() + end,
+					[&](uint32_t a, uint32_t b) { return context.primitives[a].centroid[best_axis] < context.primitives[b].centroid[best_axis]; });
+			}
+		}
+
+		uint32_t second_child = 0;
 
-		return hit_left || hit_right;
+		if (std::min(mid - start, end - mid) >= context.options.parallel_threshold && TryAcquireThread(context))
+		{
+			// Build the second child on another thread, while this one takes care of the first. The renderer has no
+			// persistent thread pool to hand it to (its threads only live for a pass), so a short-lived thread is
+			// started for each split, and the idle thread budget keeps their number within the build thread count.
+			std::vector<NodeBVH> second_nodes;
+			second_nodes.reserve(2 * size_t(end - mid) - 1);
+			std::thread worker([&]()
+			{
+				BuildRecursive(context, second_nodes, mid, end, depth + 1);
+				context.idle_threads.fetch_add(1);
+			});
+
+			BuildRecursive(context, nodes, start, mid, depth + 1);
+			worker.join();
+
+			// Relocate the second sub-tree after the first one.
+			second_child = static_cast<uint32_t>(nodes.size());
+			for (NodeBVH& node : second_nodes)
+			{
+				if (!node.IsLeaf())
+					node.offset += second_child;
+			}
+			nodes.insert(nodes.end(), second_nodes.begin(), second_nodes.end());
+		}
+		else
+		{
+			BuildRecursive(context, nodes, start, mid, depth + 1);
+			second_child = BuildRecursive(context, nodes, mid, end, depth + 1);
+		}
+
+		nodes[index].offset = second_child;
+		nodes[index].count = 0;
+		nodes[index].axis = static_cast<uint8_t>(best_axis);
+		return index;
+	}
+
+	static bool TryAcquireThread(BuildContext& context) noexcept
+	{
+		if (context.idle_threads.fetch_sub(1) > 0)
+			return true;
+
+		context.idle_threads.fetch_add(1);
+		return false;
+	}
+
+	// Copy the arrays of the hierarchy out of the external storage, so that they can be modified.
+	void CopyExternalStorage()
+	{
+		if (!m_externalStorage)
+			return;
+
+		m_nodes.assign(m_externalNodes.begin(), m_externalNodes.end());
+		m_primitives.assign(m_externalPrimitives.begin(), m_externalPrimitives.end());
+		m_motion.assign(m_externalMotion.begin(), m_externalMotion.end());
+		m_externalStorage.reset();
+	}
+
+	// Update the bounds of the given nodes (with the topology of this hierarchy) for the given primitive bounds.
+	void RefitNodes(std::vector<NodeBVH>& nodes, const std::vector<AABB>& bounds) const noexcept
+	{
+		// Children are always stored after their parent, so a reverse sweep of the
+		// array visits the nodes bottom-up and never reads stale child bounds.
+		for (size_t i = nodes.size(); i-- > 0;)
+		{
+			NodeBVH& node = nodes[i];
+
+			if (node.IsLeaf())
+			{
+				AABB box = AABB::Empty();
+				for (uint32_t p = node.offset; p < node.offset + node.count; p++)
+					box = AABB::Combine(box, bounds[m_primitives[p]]);
+				node.SetBounds(box);
+			}
+			else
+			{
+				const NodeBVH& left = nodes[i + 1];
+				const NodeBVH& right = nodes[node.offset];
+				for (int a = 0; a < 3; a++)
+				{
+					node.min[a] = std::min(left.min[a], right.min[a]);
+					node.max[a] = std::max(left.max[a], right.max[a]);
+				}
+			}
+		}
 	}
 
+	// Surface area of the box covering a node during the whole shutter interval.
+	double SurfaceArea(const size_t index) const noexcept
+	{
+		NodeBVH node = GetNodes()[index];
+		const std::span<const NodeMotionBVH> motion = GetMotion();
+		if (!motion.empty())
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				node.min[a] += std::min(motion[index].min[a], 0.0f);
+				node.max[a] += std::max(motion[index].max[a], 0.0f);
+			}
+		}
+		return SurfaceArea(node);
+	}
+
+	static double SurfaceArea(const NodeBVH& node) noexcept
+	{
+		const double dx = double(node.max[0]) - node.min[0];
+		const double dy = double(node.max[1]) - node.min[1];
+		const double dz = double(node.max[2]) - node.min[2];
+		return 2.0 * (dx * dy + dy * dz + dz * dx);
+	}
 
-	virtual bool BoundingBox(const double /*t_start*/, const double /*t_end*/, AABB& output_box)
-		const noexcept override final
+	static uint32_t GetBinIndex(const double centroid, const double min, const double scale) noexcept
 	{
-		output_box = this->box;
-		return true;
+		const uint32_t b = static_cast<uint32_t>((centroid - min) * scale);
+		return b < c_binCount ? b : c_binCount - 1;
 	}
-};
\ No newline at end of file
+};
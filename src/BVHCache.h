@@ -0,0 +1,237 @@
+#pragma once
+
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+
+#include "Common.h"
+#include "BVH.h"
+#include "MappedFile.h"
+#include "Hash.h"
+
+
+// Persistent cache of BVHs, stored in files that are memory mapped and traversed in place, without any copy.
+// Each file holds a single hierarchy, together with a key computed from everything it was built from (scene
+// contents, shutter interval and build options), so that a stale file is detected and simply replaced.
+// The hierarchies built within objects (meshes, sphere sets, prototypes) get files of their own.
+class BVHCache
+{
+public:
+
+	// Hierarchies built within objects while the scene is loaded, reported together with the scene one.
+	struct ObjectStatistics
+	{
+		uint32_t built = 0;
+		uint32_t loaded = 0;
+		double   seconds = 0.0;		// Spent building or loading them
+	};
+
+private:
+
+	static constexpr uint32_t c_magic = 0x56425452;		// "RTBV"
+	static constexpr uint32_t c_version = 3;			// Must change whenever the file layout or the builders output change
+	static constexpr uint64_t c_alignment = 64;			// Alignment of the arrays in the file
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t key;
+		uint64_t node_count;
+		uint64_t nodes_offset;
+		uint64_t primitive_count;
+		uint64_t primitives_offset;
+		uint64_t motion_count;
+		uint64_t motion_offset;
+		double   build_cost;
+		double   motion_start;
+		double   motion_scale;
+	};
+
+public:
+
+	// Compute the key identifying the BVH built for a scene file (and the external files it references) with the given parameters.
+	static uint64_t ComputeKey(const std::string& scene_path, const std::vector<std::string>& files,
+		const double t_start, const double t_end, const BuildOptionsBVH& options)
+	{
+		std::ifstream file(scene_path, std::ios::in | std::ios::binary);
+		if (!file.is_open() || file.bad())
+			throw std::exception("cannot open scene file for hashing");
+
+		const std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		// The number of threads is deliberately left out: the builders produce the same output regardless.
+		uint64_t hash = Hash::String(Hash::c_basis, contents);
+		for (const std::string& file_path : files)
+			hash = Hash::File(hash, file_path);
+		hash = Hash::Value(hash, c_version);
+		hash = Hash::Value(hash, t_start);
+		hash = Hash::Value(hash, t_end);
+		hash = Hash::Value(hash, options.max_leaf_size);
+		hash = Hash::Value(hash, options.builder);
+		hash = Hash::Value(hash, options.treelet_passes);
+		return hash;
+	}
+
+
+	// Build the hierarchy of an object over the bounds of its primitives, or load it from options.cache_path if it was
+	// saved there for the same bounds and options. The objects are loaded one after the other, which the statistics rely on.
+	static void BuildObject(BVH& bvh, const std::vector<AABB>& bounds, const BuildOptionsBVH& options)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		ObjectStatistics& statistics = GetObjectStatistics();
+
+		// The key covers the bounds themselves, rather than the files they come from, so that any
+		// transform, or any other change to the objects, is caught.
+		uint64_t key = Hash::Value(Hash::c_basis, c_version);
+		for (const AABB& box : bounds)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				key = Hash::Value(key, box.min[a]);
+				key = Hash::Value(key, box.max[a]);
+			}
+		}
+		key = Hash::Value(key, options.max_leaf_size);
+		key = Hash::Value(key, options.builder);
+		key = Hash::Value(key, options.treelet_passes);
+
+		if (!options.cache_path.empty() && Load(options.cache_path, key, bounds.size(), bvh))
+		{
+			statistics.loaded++;
+		}
+		else
+		{
+			bvh.Build(bounds, options);
+			statistics.built++;
+
+			if (!options.cache_path.empty())
+			{
+				try
+				{
+					Save(options.cache_path, key, bvh);
+				}
+				catch (const std::exception& e)
+				{
+					std::cerr << "WARNING: " << e.what() << " '" << options.cache_path << "'\n";
+				}
+			}
+		}
+
+		statistics.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+
+	static ObjectStatistics& GetObjectStatistics() noexcept
+	{
+		static ObjectStatistics statistics;
+		return statistics;
+	}
+
+
+	// Load the BVH stored in a cache file, if it exists and matches the given key and number of primitives.
+	static bool Load(const std::string& path, const uint64_t key, const size_t primitive_count, BVH& bvh)
+	{
+		std::shared_ptr<const MappedFile> file = MappedFile::Open(path);
+		if (!file || file->Size() < sizeof(Header))
+			return false;
+
+		Header header;
+		std::memcpy(&header, file->Data(), sizeof(Header));
+
+		if (header.magic != c_magic || header.version != c_version || header.key != key || header.primitive_count != primitive_count)
+			return false;
+
+		// Check that all the arrays lie entirely within the file, which could have been truncated.
+		const auto fits = [&](const uint64_t offset, const uint64_t count, const size_t element_size)
+		{
+			return offset % c_alignment == 0 && offset <= file->Size() && count <= (file->Size() - offset) / element_size;
+		};
+
+		if (!fits(header.nodes_offset, header.node_count, sizeof(NodeBVH)) ||
+			!fits(header.primitives_offset, header.primitive_count, sizeof(uint32_t)) ||
+			!fits(header.motion_offset, header.motion_count, sizeof(NodeMotionBVH)) ||
+			(header.motion_count != 0 && header.motion_count != header.node_count))
+			return false;
+
+		const uint8_t* data = file->Data();
+		MotionIntervalBVH motion_interval;
+		motion_interval.start = header.motion_start;
+		motion_interval.scale = header.motion_scale;
+
+		bvh.SetExternalStorage(file,
+			{ reinterpret_cast<const NodeBVH*>(data + header.nodes_offset), header.node_count },
+			{ reinterpret_cast<const uint32_t*>(data + header.primitives_offset), header.primitive_count },
+			{ reinterpret_cast<const NodeMotionBVH*>(data + header.motion_offset), header.motion_count },
+			motion_interval, header.build_cost);
+		return true;
+	}
+
+
+	// Store a BVH to a cache file, replacing any previous one. The file is first written under a temporary name
+	// and then renamed, so that other processes can never map an incomplete file.
+	static void Save(const std::string& path, const uint64_t key, const BVH& bvh)
+	{
+		const std::span<const NodeBVH> nodes = bvh.GetNodes();
+		const std::span<const uint32_t> primitives = bvh.GetPrimitives();
+		const std::span<const NodeMotionBVH> motion = bvh.GetMotion();
+
+		Header header = {};
+		header.magic = c_magic;
+		header.version = c_version;
+		header.key = key;
+		header.node_count = nodes.size();
+		header.nodes_offset = Align(sizeof(Header));
+		header.primitive_count = primitives.size();
+		header.primitives_offset = Align(header.nodes_offset + nodes.size_bytes());
+		header.motion_count = motion.size();
+		header.motion_offset = Align(header.primitives_offset + primitives.size_bytes());
+		header.build_cost = bvh.GetBuildCost();
+		header.motion_start = bvh.GetMotionInterval().start;
+		header.motion_scale = bvh.GetMotionInterval().scale;
+
+		const std::filesystem::path file_path(path);
+		if (file_path.has_parent_path())
+			std::filesystem::create_directories(file_path.parent_path());
+
+		const std::string temporary_path = path + ".tmp";
+		{
+			std::ofstream file(temporary_path, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!file.is_open() || file.bad())
+				throw std::exception("cannot create or open BVH cache file for writing");
+
+			WriteAt(file, 0, &header, sizeof(Header));
+			WriteAt(file, header.nodes_offset, nodes.data(), nodes.size_bytes());
+			WriteAt(file, header.primitives_offset, primitives.data(), primitives.size_bytes());
+			WriteAt(file, header.motion_offset, motion.data(), motion.size_bytes());
+
+			if (!file.good())
+				throw std::exception("cannot write BVH cache file");
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporary_path, path, error);
+		if (error)
+		{
+			std::filesystem::remove(temporary_path, error);
+			throw std::exception("cannot replace BVH cache file");
+		}
+	}
+
+private:
+
+	static uint64_t Align(const uint64_t offset) noexcept
+	{
+		return (offset + c_alignment - 1) / c_alignment * c_alignment;
+	}
+
+	static void WriteAt(std::ofstream& file, const uint64_t offset, const void* data, const size_t size)
+	{
+		// Pad the gap from the end of the previous array with zeros.
+		const uint64_t position = static_cast<uint64_t>(file.tellp());
+		for (uint64_t i = position; i < offset; i++)
+			file.put('\0');
+
+		file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+	}
+};
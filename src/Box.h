@@ -1,53 +1,79 @@
 #pragma once
 
 #include "Common.h"
-#include "Rectangle.h"
+#include "Hittable.h"
+#include "Material.h"
 
 
+// Axis-aligned box, intersected as the overlap of the three slabs between its opposite faces.
+// The face that was hit is identified by its axis and side, from which its normal and UV are derived.
 class Box : public Hittable
 {
 public:
 
 	Point3 min;
 	Point3 max;
-	std::array<std::shared_ptr<Rectangle>, 6> rectangles;
+	std::shared_ptr<Material> material;
 
 public:
 
 	Box() = default;
 	Box(const Point3& p0, const Point3& p1, std::shared_ptr<Material> material)
-		: min(p0), max(p1)
+		: min(p0), max(p1), material(material)
 	{
-		rectangles[0] = std::make_shared<Rectangle>(Point3{ p0.x(), p0.y(), p1.z() }, Point3{ p1.x(), p1.y(), p1.z() }, material);
-		rectangles[1] = std::make_shared<Rectangle>(Point3{ p0.x(), p0.y(), p0.z() }, Point3{ p1.x(), p1.y(), p0.z() }, material);
-
-		rectangles[2] = std::make_shared<Rectangle>(Point3{ p0.x(), p1.y(), p0.z() }, Point3{ p1.x(), p1.y(), p1.z() }, material);
-		rectangles[3] = std::make_shared<Rectangle>(Point3{ p0.x(), p0.y(), p0.z() }, Point3{ p1.x(), p0.y(), p1.z() }, material);
-
-		rectangles[4] = std::make_shared<Rectangle>(Point3{ p1.x(), p0.y(), p0.z() }, Point3{ p1.x(), p1.y(), p1.z() }, material);
-		rectangles[5] = std::make_shared<Rectangle>(Point3{ p0.x(), p0.y(), p0.z() }, Point3{ p0.x(), p1.y(), p1.z() }, material);
 	}
 
 
-	// Ray-Box (axis aligned) intersection checking.
+	// Ray-Box (axis aligned) intersection checking, recording the face hit as the primitive.
 	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
 		const noexcept override final
 	{
-		HitRecord last_hit;
-		bool hit_some_rectangle = false;
-		double t_closest = t_max;
+		double t_enter, t_exit;
+		uint32_t enter_face, exit_face;
+		if (!IntersectSlabs(ray, t_enter, t_exit, enter_face, exit_face))
+			return false;
 
-		for (const auto& rectangle : rectangles)
+		// A ray starting inside the box (or past its entry point) leaves it through the exit face.
+		if (t_enter >= t_min && t_enter <= t_max)
 		{
-			if (rectangle->Hit(ray, t_min, t_closest, last_hit))
-			{
-				t_closest = last_hit.t;
-				hit_some_rectangle = true;
-				hit = last_hit;
-			}
+			hit.t = t_enter;
+			hit.primitive_id = enter_face;
 		}
+		else if (t_exit >= t_min && t_exit <= t_max)
+		{
+			hit.t = t_exit;
+			hit.primitive_id = exit_face;
+		}
+		else
+		{
+			return false;
+		}
+
+		hit.object = this;
+		return true;
+	}
+
+
+	// Fill the HitRecord structure with all the info about the intersection. The UV coordinates follow those of
+	// the Rectangle with the same orientation: (x, y) on the Z faces, (x, z) on the Y faces, (y, z) on the X faces.
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
+		const int axis = FaceAxis(hit.primitive_id);
+		const bool is_max = IsMaxFace(hit.primitive_id);
+		const int a = axis == 0 ? 1 : 0;
+		const int b = axis == 2 ? 1 : 2;
 
-		return hit_some_rectangle;
+		hit.point = ray.At(hit.t);
+		hit.point[axis] = is_max ? max[axis] : min[axis];
+		hit.u = (hit.point[a] - min[a]) / (max[a] - min[a]);
+		hit.v = (hit.point[b] - min[b]) / (max[b] - min[b]);
+
+		Vector3 outward_normal;
+		outward_normal[axis] = is_max ? 1.0 : -1.0;
+		hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
+		hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
+		hit.material = material.get();
 	}
 
 
@@ -57,4 +83,103 @@ public:
 		box = AABB(min, max);
 		return true;
 	}
-};
\ No newline at end of file
+
+
+	virtual bool IsEmissive() const noexcept override final
+	{
+		return material->IsEmissive();
+	}
+
+
+	// A face is picked uniformly and then sampled, so the density is the average of those of the faces.
+	// Directions crossing the box hit two faces, both included, even if only the closest one is visible.
+	virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
+		const noexcept override final
+	{
+		double t_enter, t_exit;
+		uint32_t enter_face, exit_face;
+		if (!IntersectSlabs(Ray(origin, direction, time), t_enter, t_exit, enter_face, exit_face))
+			return 0.0;
+
+		double pdf = 0.0;
+		if (t_enter >= 0.001)
+			pdf += FacePdf(direction, t_enter, enter_face);
+		if (t_exit >= 0.001)
+			pdf += FacePdf(direction, t_exit, exit_face);
+
+		return pdf / 6.0;
+	}
+
+
+	virtual Vector3 SampleDirection(const Point3& origin, const double /*time*/)
+		const noexcept override final
+	{
+		// The same random number selects the face and then, rescaled to its range, the first coordinate.
+		const double u = Random::GetDouble(0.0, 1.0) * 6.0;
+		const uint32_t face = std::min(static_cast<uint32_t>(u), 5u);
+		const int axis = FaceAxis(face);
+		const int a = axis == 0 ? 1 : 0;
+		const int b = axis == 2 ? 1 : 2;
+
+		Point3 point;
+		point[axis] = IsMaxFace(face) ? max[axis] : min[axis];
+		point[a] = min[a] + Clamp(u - face, 0.0, 1.0) * (max[a] - min[a]);
+		point[b] = Random::GetDouble(min[b], max[b]);
+		return point - origin;
+	}
+
+private:
+
+	// Faces are numbered as 2 * axis, plus 1 for the one on the max side.
+	static int FaceAxis(const uint32_t face) noexcept { return static_cast<int>(face / 2); }
+	static bool IsMaxFace(const uint32_t face) noexcept { return (face & 1) != 0; }
+
+	// Intersect the ray with the three slabs, returning the (unbounded) interval where it is inside all of them and
+	// the faces through which it enters and leaves the box. The distances to the planes are computed exactly as the
+	// Rectangle does; a direction parallel to a slab gives infinite distances (NaN on its planes), which the ordered
+	// comparisons below never pick, so the ray is only limited by the other slabs.
+	bool IntersectSlabs(const Ray& ray, double& t_enter, double& t_exit, uint32_t& enter_face, uint32_t& exit_face) const noexcept
+	{
+		t_enter = -Infinity;
+		t_exit = Infinity;
+		enter_face = 0;
+		exit_face = 0;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const double t0 = (min[axis] - ray.origin[axis]) / ray.direction[axis];
+			const double t1 = (max[axis] - ray.origin[axis]) / ray.direction[axis];
+
+			// With a negative direction the ray enters the slab through its max plane.
+			const bool negative = ray.direction[axis] < 0.0;
+			const double t_near = negative ? t1 : t0;
+			const double t_far = negative ? t0 : t1;
+
+			if (t_near > t_enter)
+			{
+				t_enter = t_near;
+				enter_face = 2 * axis + (negative ? 1 : 0);
+			}
+			if (t_far < t_exit)
+			{
+				t_exit = t_far;
+				exit_face = 2 * axis + (negative ? 0 : 1);
+			}
+		}
+
+		return t_enter <= t_exit;
+	}
+
+	// Solid angle density of the directions towards points uniformly distributed on a face, as for a Rectangle.
+	double FacePdf(const Vector3& direction, const double t, const uint32_t face) const noexcept
+	{
+		const int axis = FaceAxis(face);
+		const int a = axis == 0 ? 1 : 0;
+		const int b = axis == 2 ? 1 : 2;
+
+		const double sqr_length = direction.SqrLength();
+		const double sqr_distance = t * t * sqr_length;
+		const double cosine = std::fabs(direction[axis]) / std::sqrt(sqr_length);
+		return sqr_distance / (cosine * (max[a] - min[a]) * (max[b] - min[b]));
+	}
+};
@@ -66,6 +66,12 @@ public:
     double GetTimeShutterOpen()  const noexcept { return m_timeStart; }
     double GetTimeShutterClose() const noexcept { return m_timeEnd;   }
 
+    void SetShutter(const double time_start, const double time_end) noexcept
+    {
+        m_timeStart = time_start;
+        m_timeEnd = time_end;
+    }
+
     Ray GetRay(const double s, const double t) const noexcept
     {
         // In order to accomplish defocus blur, generate random scene rays
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Common.h"
+#include "Framebuffer.h"
+#include "RenderSettings.h"
+#include "Hash.h"
+
+
+// Snapshot of an in-progress render, from which it can be resumed: the accumulated samples, sample counts and
+// stop decisions of all the pixels, and the number of passes rendered, which determines the random number streams
+// to use next (the per-pixel streams and the samplers only depend on the pixel and sample indices, which are all stored).
+class Checkpoint
+{
+private:
+
+	static constexpr uint32_t c_magic = 0x4b435452;		// "RTCK"
+	static constexpr uint32_t c_version = 3;			// Must change whenever the file layout or the sample dimensions change
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t key;
+		uint32_t width;
+		uint32_t height;
+		uint32_t pass_count;
+		uint32_t sample_target;		// Settings the pixels were stopped with
+		uint32_t min_samples;
+		uint32_t reserved;
+		double   noise_threshold;
+	};
+
+public:
+
+	// Settings deciding when the pixels stop sampling, which are not part of the key (a render can be resumed with
+	// a higher target): the stop decisions stored in a checkpoint are only kept if they are the same.
+	struct StopCriteria
+	{
+		uint32_t sample_target;
+		uint32_t min_samples;
+		double   noise_threshold;
+
+		explicit StopCriteria(const RenderSettings& settings) noexcept
+			: sample_target(settings.SampleTarget()), min_samples(settings.MinSamplesPerPixel()), noise_threshold(settings.NoiseThreshold()) {}
+	};
+
+	// Compute the key identifying the renders that can be continued from each other's checkpoints: the same scene
+	// (and external files) and shutter interval, with the same settings affecting the samples (their number, the number of threads
+	// and the time limit can change freely, except for the stratified sampler which depends on the former).
+	static uint64_t ComputeKey(const RenderSettings& settings, const std::vector<std::string>& files, const double t_start, const double t_end)
+	{
+		std::ifstream file(settings.ScenePath(), std::ios::in | std::ios::binary);
+		if (!file.is_open() || file.bad())
+			throw std::exception("cannot open scene file for hashing");
+
+		const std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		uint64_t hash = Hash::String(Hash::c_basis, contents);
+		for (const std::string& file_path : files)
+			hash = Hash::File(hash, file_path);
+		hash = Hash::Value(hash, c_version);
+		hash = Hash::Value(hash, t_start);
+		hash = Hash::Value(hash, t_end);
+		hash = Hash::Value(hash, settings.MaxBounces());
+		hash = Hash::Value(hash, settings.RussianRouletteDepth());
+		hash = Hash::Value(hash, settings.GetRandomStreams());
+		hash = Hash::Value(hash, settings.GetSamplerType());
+		if (settings.GetSamplerType() == SamplerType::Stratified)
+			hash = Hash::Value(hash, settings.SampleTarget());
+		return hash;
+	}
+
+
+	// Load a checkpoint into a framebuffer of the same size. The pixels that had stopped stay so, unless the
+	// stop criteria changed, in which case all of them are marked as active to be tested again.
+	static void Load(const std::string& path, const uint64_t key, const StopCriteria& criteria, Framebuffer& framebuffer)
+	{
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		if (!file.is_open() || file.bad())
+			throw std::exception("cannot open checkpoint file");
+
+		Header header = {};
+		file.read(reinterpret_cast<char*>(&header), sizeof(Header));
+
+		if (!file.good() || header.magic != c_magic || header.version != c_version)
+			throw std::exception("not a valid checkpoint file");
+
+		if (header.key != key || header.width != framebuffer.GetWidth() || header.height != framebuffer.GetHeight())
+			throw std::exception("checkpoint file was saved for a different scene or settings");
+
+		const size_t pixel_count = size_t(header.width) * header.height;
+		std::vector<double> sums(pixel_count * 5);
+		std::vector<uint32_t> counts(pixel_count);
+		std::vector<uint32_t> next_passes(pixel_count);
+		std::vector<uint8_t> active(pixel_count);
+		file.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(double));
+		file.read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(uint32_t));
+		file.read(reinterpret_cast<char*>(next_passes.data()), next_passes.size() * sizeof(uint32_t));
+		file.read(reinterpret_cast<char*>(active.data()), active.size() * sizeof(uint8_t));
+
+		if (!file.good())
+			throw std::exception("checkpoint file is truncated");
+
+		const bool same_criteria = header.sample_target == criteria.sample_target &&
+			header.min_samples == criteria.min_samples && header.noise_threshold == criteria.noise_threshold;
+
+		for (uint32_t y = 0, i = 0; y < header.height; y++)
+		{
+			for (uint32_t x = 0; x < header.width; x++, i++)
+			{
+				Framebuffer::Pixel& pixel = framebuffer.At(x, y);
+				pixel.color = Color(sums[i * 5], sums[i * 5 + 1], sums[i * 5 + 2]);
+				pixel.luminance_sum = sums[i * 5 + 3];
+				pixel.luminance_sqr_sum = sums[i * 5 + 4];
+				pixel.count = counts[i];
+				pixel.next_pass = next_passes[i];
+				pixel.active = !same_criteria || active[i] != 0;
+			}
+		}
+
+		framebuffer.SetPassCount(header.pass_count);
+	}
+
+
+	// Store a checkpoint, replacing any previous one. The file is first written under a temporary name
+	// and then renamed, so that a crash while writing it never leaves an incomplete checkpoint behind.
+	static void Save(const std::string& path, const uint64_t key, const StopCriteria& criteria, const Framebuffer& framebuffer)
+	{
+		Header header = {};
+		header.magic = c_magic;
+		header.version = c_version;
+		header.key = key;
+		header.width = framebuffer.GetWidth();
+		header.height = framebuffer.GetHeight();
+		header.pass_count = framebuffer.GetPassCount();
+		header.sample_target = criteria.sample_target;
+		header.min_samples = criteria.min_samples;
+		header.noise_threshold = criteria.noise_threshold;
+
+		const size_t pixel_count = size_t(header.width) * header.height;
+		std::vector<double> sums;
+		std::vector<uint32_t> counts;
+		std::vector<uint32_t> next_passes;
+		std::vector<uint8_t> active;
+		sums.reserve(pixel_count * 5);
+		counts.reserve(pixel_count);
+		next_passes.reserve(pixel_count);
+		active.reserve(pixel_count);
+
+		for (uint32_t y = 0; y < header.height; y++)
+		{
+			for (uint32_t x = 0; x < header.width; x++)
+			{
+				const Framebuffer::Pixel& pixel = framebuffer.At(x, y);
+				sums.insert(sums.end(), { pixel.color.x(), pixel.color.y(), pixel.color.z(), pixel.luminance_sum, pixel.luminance_sqr_sum });
+				counts.push_back(pixel.count);
+				next_passes.push_back(pixel.next_pass);
+				active.push_back(pixel.active ? 1 : 0);
+			}
+		}
+
+		const std::filesystem::path file_path(path);
+		if (file_path.has_parent_path())
+			std::filesystem::create_directories(file_path.parent_path());
+
+		const std::string temporary_path = path + ".tmp";
+		{
+			std::ofstream file(temporary_path, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!file.is_open() || file.bad())
+				throw std::exception("cannot create or open checkpoint file for writing");
+
+			file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			file.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(double));
+			file.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(uint32_t));
+			file.write(reinterpret_cast<const char*>(next_passes.data()), next_passes.size() * sizeof(uint32_t));
+			file.write(reinterpret_cast<const char*>(active.data()), active.size() * sizeof(uint8_t));
+
+			if (!file.good())
+				throw std::exception("cannot write checkpoint file");
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporary_path, path, error);
+		if (error)
+		{
+			std::filesystem::remove(temporary_path, error);
+			throw std::exception("cannot replace checkpoint file");
+		}
+	}
+};
+
+
+// Saves checkpoints on a background thread, so that rendering can go on while they are written to disk.
+// Only the latest snapshot submitted is saved, any older one still waiting is simply dropped.
+class CheckpointWriter
+{
+private:
+
+	const std::string              m_path;
+	const uint64_t                 m_key;
+	const Checkpoint::StopCriteria m_criteria;
+
+	std::mutex                   m_mutex;
+	std::condition_variable      m_condition;
+	std::unique_ptr<Framebuffer> m_pending;
+	bool                         m_writing = false;
+	bool                         m_stop = false;
+
+	std::thread m_thread;		// Must be the last member, so that it starts after everything else is initialized
+
+public:
+
+	CheckpointWriter(const std::string& path, const uint64_t key, const Checkpoint::StopCriteria& criteria)
+		: m_path(path), m_key(key), m_criteria(criteria), m_thread(&CheckpointWriter::WriteLoop, this) {}
+
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	// Any checkpoint still pending is written before returning.
+	~CheckpointWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_condition.notify_all();
+		m_thread.join();
+	}
+
+	std::string GetPath() const noexcept
+	{
+		return m_path;
+	}
+
+	// Take a copy of the framebuffer to be saved, which is the only work done by the calling thread.
+	void Submit(const Framebuffer& framebuffer)
+	{
+		std::unique_ptr<Framebuffer> snapshot = std::make_unique<Framebuffer>(framebuffer);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending = std::move(snapshot);
+		}
+		m_condition.notify_all();
+	}
+
+	// Wait until all the checkpoints submitted have been written.
+	void Flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_condition.wait(lock, [this]() { return !m_pending && !m_writing; });
+	}
+
+private:
+
+	void WriteLoop() noexcept
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_condition.wait(lock, [this]() { return m_pending || m_stop; });
+			if (!m_pending)
+				return;
+
+			const std::unique_ptr<Framebuffer> snapshot = std::move(m_pending);
+			m_writing = true;
+			lock.unlock();
+
+			try
+			{
+				Checkpoint::Save(m_path, m_key, m_criteria, *snapshot);
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << "WARNING: " << e.what() << " '" << m_path << "'\n";
+			}
+
+			lock.lock();
+			m_writing = false;
+			m_condition.notify_all();
+		}
+	}
+};
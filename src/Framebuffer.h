@@ -0,0 +1,194 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Common.h"
+#include "Image.h"
+
+
+// High dynamic range accumulation buffer, holding the running sums of the samples taken in each pixel,
+// so that rendering can go on in passes over the whole image, and be stopped after any of them.
+// The final (gamma-corrected, 8-bit) image is obtained by averaging the samples with Resolve().
+class Framebuffer
+{
+public:
+
+	struct Pixel
+	{
+		Color    color;						// Sum of the samples
+		double   luminance_sum = 0.0;
+		double   luminance_sqr_sum = 0.0;
+		uint32_t count = 0;
+		uint32_t next_pass = 0;				// First pass that has not sampled it yet (a pass cut short by the time limit is resumed)
+		bool     active = true;				// Needs more samples
+	};
+
+private:
+
+	uint32_t m_width;
+	uint32_t m_height;
+	uint32_t m_passCount = 0;			// Rendering passes accumulated so far
+	std::vector<Pixel> m_pixels;
+
+public:
+
+	Framebuffer(const uint32_t width, const uint32_t height)
+		: m_width(width), m_height(height), m_pixels(size_t(width) * height) {}
+
+
+	uint32_t GetWidth() const noexcept
+	{
+		return m_width;
+	}
+
+	uint32_t GetHeight() const noexcept
+	{
+		return m_height;
+	}
+
+	uint32_t GetPassCount() const noexcept
+	{
+		return m_passCount;
+	}
+
+	void SetPassCount(const uint32_t count) noexcept
+	{
+		m_passCount = count;
+	}
+
+	Pixel& At(const uint32_t x, const uint32_t y) noexcept
+	{
+		return m_pixels[size_t(y) * m_width + x];
+	}
+
+	const Pixel& At(const uint32_t x, const uint32_t y) const noexcept
+	{
+		return m_pixels[size_t(y) * m_width + x];
+	}
+
+
+	static void AddSample(Pixel& pixel, const Color& sample) noexcept
+	{
+		const double luminance = Luminance(sample);
+
+		pixel.color += sample;
+		pixel.luminance_sum += luminance;
+		pixel.luminance_sqr_sum += luminance * luminance;
+		pixel.count++;
+	}
+
+
+	bool HasActivePixels() const noexcept
+	{
+		return std::any_of(m_pixels.begin(), m_pixels.end(), [](const Pixel& pixel) { return pixel.active; });
+	}
+
+
+	uint64_t GetSampleCount() const noexcept
+	{
+		uint64_t count = 0;
+		for (const Pixel& pixel : m_pixels)
+			count += pixel.count;
+		return count;
+	}
+
+	uint32_t GetMinSampleCount() const noexcept
+	{
+		uint32_t count = std::numeric_limits<uint32_t>::max();
+		for (const Pixel& pixel : m_pixels)
+			count = std::min(count, pixel.count);
+		return m_pixels.empty() ? 0 : count;
+	}
+
+
+	/* Decide which pixels need more samples, returning false if none of them does.
+		@param max_samples      Pixels with as many samples are always done.
+		@param min_samples      Pixels with fewer samples always need more (ignored without a threshold).
+		@param noise_threshold  Pixels with an estimated error below it are done (0 = disabled).
+	*/
+	bool UpdateActivePixels(const uint32_t max_samples, const uint32_t min_samples, const double noise_threshold) noexcept
+	{
+		// A pixel stops only when its error and that of all its neighbors are below the threshold: the error
+		// estimates are themselves noisy, and this keeps a pixel with an unlucky estimate from stopping too early.
+		std::vector<double> errors(m_pixels.size(), Infinity);
+		if (noise_threshold > 0.0)
+		{
+			for (size_t p = 0; p < m_pixels.size(); p++)
+			{
+				if (m_pixels[p].count >= min_samples)
+					errors[p] = PixelError(m_pixels[p]);
+			}
+		}
+
+		bool any_active = false;
+		for (uint32_t y = 0; y < m_height; y++)
+		{
+			for (uint32_t x = 0; x < m_width; x++)
+			{
+				Pixel& pixel = At(x, y);
+				if (!pixel.active)
+					continue;
+
+				double error = 0.0;
+				for (uint32_t ny = (y > 0 ? y - 1 : 0); ny <= std::min(y + 1, m_height - 1); ny++)
+					for (uint32_t nx = (x > 0 ? x - 1 : 0); nx <= std::min(x + 1, m_width - 1); nx++)
+						error = std::max(error, errors[size_t(ny) * m_width + nx]);
+
+				pixel.active = pixel.count < max_samples && !(error < noise_threshold);
+				any_active |= pixel.active;
+			}
+		}
+
+		return any_active;
+	}
+
+
+	// Average the samples of each pixel into the output image (pixels without samples are black).
+	void Resolve(Image& image) const noexcept
+	{
+		for (uint32_t y = 0; y < m_height; y++)
+		{
+			for (uint32_t x = 0; x < m_width; x++)
+			{
+				const Pixel& pixel = At(x, y);
+				image.SetPixel(x, y, pixel.count ? pixel.color / pixel.count : Color(0, 0, 0));
+			}
+		}
+	}
+
+
+	// Write the number of samples of each pixel, relative to the given maximum, as a false color image
+	// going from black (no samples) through red and yellow to white (all the samples).
+	void ResolveHeatmap(Image& image, const uint32_t max_samples) const noexcept
+	{
+		for (uint32_t y = 0; y < m_height; y++)
+		{
+			for (uint32_t x = 0; x < m_width; x++)
+			{
+				const double value = static_cast<double>(At(x, y).count) / max_samples;
+				image.SetValue(x, y, Color(Clamp(3.0 * value, 0.0, 1.0), Clamp(3.0 * value - 1.0, 0.0, 1.0), Clamp(3.0 * value - 2.0, 0.0, 1.0)));
+			}
+		}
+	}
+
+private:
+
+	static double Luminance(const Color& color) noexcept
+	{
+		return 0.2126 * color.x() + 0.7152 * color.y() + 0.0722 * color.z();
+	}
+
+	// Estimate the error of a pixel from the running sums of its sample luminances: the standard error of their
+	// mean, propagated through the gamma correction (a square root), so that it is measured on the final [0, 1]
+	// scale of the image, where the same error is much more visible in dark regions than in bright ones.
+	static double PixelError(const Pixel& pixel) noexcept
+	{
+		if (pixel.count < 2)
+			return Infinity;
+
+		const double mean = pixel.luminance_sum / pixel.count;
+		const double variance = std::max(0.0, (pixel.luminance_sqr_sum - pixel.luminance_sum * mean) / (pixel.count - 1));
+		return std::sqrt(variance / pixel.count) / (2.0 * std::sqrt(std::max(mean, 1e-4)));
+	}
+};
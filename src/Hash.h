@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+
+#include "Common.h"
+
+
+// 64-bit FNV-1a hash, used to compute the keys that identify the data cached on disk.
+class Hash
+{
+public:
+
+	static constexpr uint64_t c_basis = 0xcbf29ce484222325ull;
+	static constexpr uint64_t c_prime = 0x100000001b3ull;
+
+	static uint64_t Bytes(uint64_t hash, const void* data, const size_t size) noexcept
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++)
+			hash = (hash ^ bytes[i]) * c_prime;
+		return hash;
+	}
+
+	template <typename T>
+	static uint64_t Value(const uint64_t hash, const T value) noexcept
+	{
+		return Bytes(hash, &value, sizeof(T));
+	}
+
+	static uint64_t String(const uint64_t hash, const std::string& value) noexcept
+	{
+		return Bytes(hash, value.data(), value.size());
+	}
+
+	// Identify the version of a file from its path, size and modification time, which is much cheaper
+	// than hashing the contents of large files (e.g. meshes). Missing files only contribute their path.
+	static uint64_t File(uint64_t hash, const std::string& path) noexcept
+	{
+		std::error_code error;
+		hash = String(hash, path);
+
+		const uintmax_t size = std::filesystem::file_size(path, error);
+		if (!error)
+			hash = Value(hash, size);
+
+		const auto time = std::filesystem::last_write_time(path, error);
+		if (!error)
+			hash = Value(hash, time.time_since_epoch().count());
+
+		return hash;
+	}
+};
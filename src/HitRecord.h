@@ -2,13 +2,19 @@
 
 #include "Vector3.h"
 
-class Material;		// Forward declaration
+class Material;		// Forward declarations
+class Hittable;
 
 
 // Contains the information about a ray-object intersection.
+// Only t, object, primitive_id and prototype_object are written while searching for the closest hit, all the other
+// surface attributes are filled in afterwards, by calling SurfaceAttributes() on the object.
 struct HitRecord
 {
     double           t = 0.0;
+    const Hittable*  object = nullptr;
+    uint32_t         primitive_id = 0;         // Identifies the part of the object that was hit, if it has many
+    const Hittable*  prototype_object = nullptr; // Object hit within a prototype, which fills in the surface attributes
     double           u = 0.0;
     double           v = 0.0;
     Point3           point;
@@ -11,6 +11,25 @@ public:
 
     virtual ~Hittable() = default;
 
+    // Find the closest intersection in [t_min, t_max], only recording its distance (t) and what was hit (object, primitive_id).
+    // This is called for every candidate intersection along the ray, most of which turn out to be hidden by a closer one.
     virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit) const noexcept = 0;
+
+    // Compute all the other surface attributes (point, normal, UV, material...) of a hit found by Hit(),
+    // which is done just once for the closest intersection of the ray.
+    virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit) const noexcept = 0;
+
     virtual bool BoundingBox(const double t_start, const double t_end, AABB& box) const noexcept = 0;
+
+    // Light sampling (next event estimation) is only supported by objects made of an emissive material,
+    // which are the ones collected in the scene light list.
+    virtual bool IsEmissive() const noexcept { return false; }
+
+    // Probability density, per unit solid angle, of SampleDirection() picking the given direction from the origin.
+    virtual double DirectionPdf([[maybe_unused]] const Point3& origin, [[maybe_unused]] const Vector3& direction,
+        [[maybe_unused]] const double time) const noexcept { return 0.0; }
+
+    // Pick a random direction from the origin towards a point on the object (not normalized).
+    virtual Vector3 SampleDirection([[maybe_unused]] const Point3& origin, [[maybe_unused]] const double time)
+        const noexcept { return Vector3(1.0, 0.0, 0.0); }
 };
@@ -55,6 +55,17 @@ public:
 	}
 
 
+	// Write a value already in [0, 1], without any gamma correction (e.g. for false color images).
+	void SetValue(const uint32_t x, const uint32_t y, const Color& value) noexcept
+	{
+		const uint64_t i = (uint64_t(y) * m_width + uint64_t(x)) * 3;
+
+		m_pixels[i  ] = static_cast<uint8_t>(256 * Clamp(value.x(), 0.0, 0.999999));
+		m_pixels[i+1] = static_cast<uint8_t>(256 * Clamp(value.y(), 0.0, 0.999999));
+		m_pixels[i+2] = static_cast<uint8_t>(256 * Clamp(value.z(), 0.0, 0.999999));
+	}
+
+
 	void WriteToDisk(const std::string& filename) const
 	{
 		// Create the image file
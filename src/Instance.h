@@ -2,140 +2,103 @@
 
 #include "Common.h"
 #include "Hittable.h"
+#include "Transform.h"
 
 
-class Translate : public Hittable
+// Object placed in the scene by an affine transform (any combination of rotation, scale and translation).
+// Instead of actually transforming the object, the rays are brought into its own space by the inverse
+// transform: the direction is not normalized there, so the distances along the ray stay the same.
+class Instance : public Hittable
 {
-public:
+private:
 
-	Vector3 offset;
-	std::shared_ptr<Hittable> object;
+	std::shared_ptr<Hittable> m_object;
+	Transform m_toWorld;
+	Transform m_toObject;				// Inverse of the transform, for the rays
+	Transform m_normalToWorld;			// Transpose of the inverse, for the normals
+	double    m_inverseDeterminant;		// Ratio of the volumes in object and world space, for the light densities
 
 public:
 
-	Translate(std::shared_ptr<Hittable> obj, const Vector3& offset)
-		: offset(offset), object(obj)
+	Instance(std::shared_ptr<Hittable> object, const Transform& transform)
+		: m_object(object),
+		  m_toWorld(transform),
+		  m_toObject(transform.Inverse()),
+		  m_normalToWorld(transform.NormalTransform()),
+		  m_inverseDeterminant(std::fabs(1.0 / transform.Determinant()))
 	{}
 
 
-	// Ray-Object intersection checking with translation.
+	// Ray-Object intersection checking, in the space of the object.
 	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
 		const noexcept override final
 	{
-		// Instead of actually translating the object, we translate the ray
-		// in the opposite direction before intersecting it with the object
-		// (which stays at its original position)
-		Ray ray_translated(ray.origin - offset, ray.direction, ray.time);
-		if (!object->Hit(ray_translated, t_min, t_max, hit))
+		if (!m_object->Hit(ToObject(ray), t_min, t_max, hit))
 			return false;
 
-		// Translate back the hit point
-		hit.point += offset;
+		hit.object = this;
 		return true;
 	}
 
 
-	// Translated bounding box.
-	virtual bool BoundingBox(const double t_start, const double t_end, AABB& box)
+	// The object fills in the attributes in its own space, then the point and the normal are brought back to the
+	// world. The normal transform preserves the sign of its dot product with the ray direction, so the side of
+	// the surface that was hit does not change.
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
 		const noexcept override final
 	{
-		if (!object->BoundingBox(t_start, t_end, box))
-			return false;
+		m_object->SurfaceAttributes(ToObject(ray), hit);
 
-		box.min += offset;
-		box.max += offset;
-		return true;
+		hit.point = m_toWorld.ApplyToPoint(hit.point);
+		hit.normal = Vector3::Normalized(m_normalToWorld.ApplyToVector(hit.normal));
 	}
-};
 
 
-class Rotate_Y : public Hittable
-{
-public:
+	// Transformed bounding box.
+	virtual bool BoundingBox(const double t_start, const double t_end, AABB& box)
+		const noexcept override final
+	{
+		if (!m_object->BoundingBox(t_start, t_end, box))
+			return false;
 
-	double sin_theta;
-	double cos_theta;
-	std::shared_ptr<Hittable> object;
+		box = m_toWorld.ApplyToBox(box);
+		return true;
+	}
 
-public:
 
-	Rotate_Y(std::shared_ptr<Hittable> obj, const double angle)
-		: object(obj)
+	virtual bool IsEmissive() const noexcept override final
 	{
-		const double radians = Deg2Rad(angle);
-		sin_theta = std::sin(radians);
-		cos_theta = std::cos(radians);
+		return m_object->IsEmissive();
 	}
 
 
-	// Ray-Object intersection checking with rotation around the Y axis.
-	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
+	// The density of the directions in object space is converted to world space through the Jacobian of the mapping
+	// between the unit directions: through the inverse linear part M, the solid angles around a world direction w
+	// are scaled by |det(M)| / |M w|^3 in object space (which is just 1 for rotations).
+	virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
 		const noexcept override final
 	{
-		Point3  origin = ray.origin;
-		Vector3 direction = ray.direction;
+		const Vector3 object_direction = m_toObject.ApplyToVector(Vector3::Normalized(direction));
+		const double pdf = m_object->DirectionPdf(m_toObject.ApplyToPoint(origin), object_direction, time);
+		if (pdf == 0.0)
+			return 0.0;
 
-		// Rotate the ray origin and direction around the Y axis
-		origin[0] = cos_theta * ray.origin[0] - sin_theta * ray.origin[2];
-		origin[2] = sin_theta * ray.origin[0] + cos_theta * ray.origin[2];
-		direction[0] = cos_theta * ray.direction[0] - sin_theta * ray.direction[2];
-		direction[2] = sin_theta * ray.direction[0] + cos_theta * ray.direction[2];
-
-		Ray ray_rotated(origin, direction, ray.time);
-
-		if (!object->Hit(ray_rotated, t_min, t_max, hit))
-			return false;
-
-		Point3 point = hit.point;
-		Vector3 normal = hit.normal;
-
-		// Rotate back the hit point and surface normal
-		point[0] =  cos_theta * hit.point[0] + sin_theta * hit.point[2];
-		point[2] = -sin_theta * hit.point[0] + cos_theta * hit.point[2];
-		normal[0] =  cos_theta * hit.normal[0] + sin_theta * hit.normal[2];
-		normal[2] = -sin_theta * hit.normal[0] + cos_theta * hit.normal[2];
-
-		hit.point = point;
-		hit.is_front_face = Vector3::Dot(ray_rotated.direction, normal) < 0.0;
-		hit.normal = hit.is_front_face ? normal : -normal;
-		return true;
+		const double length = object_direction.Length();
+		return pdf * m_inverseDeterminant / (length * length * length);
 	}
 
 
-	// Rotated bounding box.
-	virtual bool BoundingBox(const double t_start, const double t_end, AABB& box)
+	// Points sampled on the object are mapped to the world, together with the vectors to them.
+	virtual Vector3 SampleDirection(const Point3& origin, const double time)
 		const noexcept override final
 	{
-		if (!object->BoundingBox(t_start, t_end, box))
-			return false;
+		return m_toWorld.ApplyToVector(m_object->SampleDirection(m_toObject.ApplyToPoint(origin), time));
+	}
 
-		Point3 min( Infinity,  Infinity,  Infinity);
-		Point3 max(-Infinity, -Infinity, -Infinity);
-
-		for (int i = 0; i < 2; i++)
-		{
-			for (int j = 0; j < 2; j++)
-			{
-				for (int k = 0; k < 2; k++)
-				{
-					const double x = i * box.max.x() + (1 - i) * box.min.x();
-					const double y = j * box.max.y() + (1 - j) * box.min.y();
-					const double z = k * box.max.z() + (1 - k) * box.min.z();
-
-					const double newx =  cos_theta * x + sin_theta * z;
-					const double newz = -sin_theta * x + cos_theta * z;
-
-					min[0] = std::min(min[0], newx);
-					min[1] = std::min(min[1], y);
-					min[2] = std::min(min[2], newz);
-					max[0] = std::max(max[0], newx);
-					max[1] = std::max(max[1], y);
-					max[2] = std::max(max[2], newz);
-				}
-			}
-		}
-
-		box = AABB(min, max);
-		return true;
+private:
+
+	Ray ToObject(const Ray& ray) const noexcept
+	{
+		return Ray(m_toObject.ApplyToPoint(ray.origin), m_toObject.ApplyToVector(ray.direction), ray.time);
 	}
-};
\ No newline at end of file
+};
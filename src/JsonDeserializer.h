@@ -1,17 +1,24 @@
 #pragma once
 
 #include <fstream>
+#include <unordered_map>
 
 #include "Vector3.h"
 #include "Material.h"
 #include "Sphere.h"
+#include "SphereSet.h"
 #include "MovingSphere.h"
 #include "Rectangle.h"
 #include "Box.h"
+#include "Mesh.h"
+#include "MeshLoader.h"
 #include "Instance.h"
+#include "Prototype.h"
+#include "Transform.h"
 #include "Volume.h"
 #include "Camera.h"
 #include "Scene.h"
+#include "RenderSettings.h"
 
 #include "nlohmann/json.hpp"
 using json = nlohmann::ordered_json;
@@ -42,10 +49,32 @@ public:
 };
 
 
+// Options of the hierarchies built within objects (meshes, sphere sets, prototypes), following those of the scene one.
+// Each object gets its own cache file, numbered in the order in which the objects are loaded.
+static BuildOptionsBVH GetObjectBuildOptions()
+{
+    static uint32_t object_index = 0;
+
+    const RenderSettings& settings = RenderSettings::Get();
+    BuildOptionsBVH options;
+    options.max_leaf_size = settings.BVHLeafSize();
+    options.width = settings.BVHWidth();
+    options.builder = settings.GetBVHBuilder();
+    options.treelet_passes = settings.BVHTreeletPasses();
+    options.thread_count = settings.BuildThreadCount();
+
+    const std::string cache_path = settings.BVHCachePath();
+    if (!cache_path.empty())
+        options.cache_path = cache_path.substr(0, cache_path.size() - 4) + ".object" + std::to_string(object_index++) + ".bvh";
+
+    return options;
+}
+
+
 // Vector3 deserialization
 void from_json(const json& j, Vector3& vec)
 {
-    j.get_to(vec.values);
+    vec = Vector3(j.at(0).get<double>(), j.at(1).get<double>(), j.at(2).get<double>());
 }
 
 
@@ -105,10 +134,100 @@ void from_json(const json& j, std::shared_ptr<Material>& material)
 }
 
 
+// Transform of an object, combining its optional "scale" (a single factor or one per axis), "rotate" (angles in
+// degrees around the X, Y and Z axes, applied in this order), "rotate_y" (in degrees) and "translate" keys,
+// which are applied in the order in which they are listed here.
+static Transform GetTransform(const json& j)
+{
+    Transform transform;
+
+    if (j.contains("scale"))
+    {
+        const auto& scale = j.at("scale");
+        transform = Transform::Scale(scale.is_number() ? Vector3(scale.get<double>(), scale.get<double>(), scale.get<double>()) : scale.get<Vector3>()) * transform;
+    }
+    if (j.contains("rotate"))
+    {
+        const Vector3 angles = j.at("rotate").get<Vector3>();
+        for (int axis = 0; axis < 3; axis++)
+            transform = Transform::Rotation(axis, angles[axis]) * transform;
+    }
+    if (j.contains("rotate_y"))
+    {
+        transform = Transform::Rotation(1, j.at("rotate_y").get<double>()) * transform;
+    }
+    if (j.contains("translate"))
+    {
+        transform = Transform::Translation(j.at("translate").get<Vector3>()) * transform;
+    }
+
+    if (transform.Determinant() == 0.0)
+        throw std::exception("Invalid object transform: the scale factors cannot be zero!");
+
+    return transform;
+}
+
+
+// Apply a transform directly to the primitives that keep their shape under it, which spares the instance and
+// the transform of every ray: spheres under a uniform scale, and axis-aligned shapes under a scale along the axes.
+// Positive factors keep their texture coordinates (and corners) in the same order.
+static bool BakeTransform(std::shared_ptr<Hittable>& hittable, const Transform& transform)
+{
+    if (!transform.IsDiagonal() || transform.m[0][0] <= 0.0 || transform.m[1][1] <= 0.0 || transform.m[2][2] <= 0.0)
+        return false;
+
+    if (const auto sphere = std::dynamic_pointer_cast<Sphere>(hittable))
+    {
+        const double scale = transform.m[0][0];
+        if (transform.m[1][1] != scale || transform.m[2][2] != scale)
+            return false;
+
+        hittable = std::make_shared<Sphere>(transform.ApplyToPoint(sphere->center), sphere->radius * scale, sphere->material);
+        return true;
+    }
+    if (const auto rectangle = std::dynamic_pointer_cast<Rectangle>(hittable))
+    {
+        hittable = std::make_shared<Rectangle>(
+            transform.ApplyToPoint(rectangle->PlanePoint(rectangle->a0, rectangle->b0)),
+            transform.ApplyToPoint(rectangle->PlanePoint(rectangle->a1, rectangle->b1)),
+            rectangle->material);
+        return true;
+    }
+    if (const auto box = std::dynamic_pointer_cast<Box>(hittable))
+    {
+        hittable = std::make_shared<Box>(transform.ApplyToPoint(box->min), transform.ApplyToPoint(box->max), box->material);
+        return true;
+    }
+
+    return false;
+}
+
+
+// Bring the vertices (and normals) of a mesh into the world, so that it needs no instance under any transform.
+// A mirroring transform also reverses the winding of the triangles, which is restored so that their geometric
+// normals (from the order of the vertices) still point outwards.
+static void BakeTransform(MeshData& mesh, const Transform& transform)
+{
+    const Transform normal_transform = transform.NormalTransform();
+
+    for (Point3& position : mesh.positions)
+        position = transform.ApplyToPoint(position);
+    for (Vector3& normal : mesh.normals)
+        normal = Vector3::Normalized(normal_transform.ApplyToVector(normal));
+
+    if (transform.Determinant() < 0.0)
+    {
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+            std::swap(mesh.indices[i + 1], mesh.indices[i + 2]);
+    }
+}
+
+
 // Hittable objects deserialization
 void from_json(const json& j, std::shared_ptr<Hittable>& hittable)
 {
     const std::string type = j.at("type").get<std::string>();
+    Transform transform = GetTransform(j);
 
     if (type == "Sphere")
     {
@@ -140,18 +259,25 @@ void from_json(const json& j, std::shared_ptr<Hittable>& hittable)
             j.at("upperCorner").get<Point3>(),
             j.at("material").get<std::shared_ptr<Material>>());
     }
+    else if (type == "Mesh")
+    {
+        MeshData data = MeshLoader::Load(j.at("filename").get<std::string>());
+        BakeTransform(data, transform);
+        transform = Transform::Identity();
+
+        hittable = std::make_shared<Mesh>(
+            std::move(data),
+            j.at("material").get<std::shared_ptr<Material>>(),
+            GetObjectBuildOptions());
+    }
     else
     {
         throw std::exception(("Unsupported hittable object type: " + type).c_str());
     }
 
-    if (j.contains("rotate_y"))
+    if (!transform.IsIdentity() && !BakeTransform(hittable, transform))
     {
-        hittable = std::make_shared<Rotate_Y>(hittable, j.at("rotate_y"));
-    }
-    if (j.contains("translate"))
-    {
-        hittable = std::make_shared<Translate>(hittable, j.at("translate"));
+        hittable = std::make_shared<Instance>(hittable, transform);
     }
     if (j.contains("volume"))
     {
@@ -180,10 +306,95 @@ void from_json(const json& j, std::shared_ptr<Hittable>& hittable)
 }
 
 
+// Gather the plain spheres among the objects into a single set, which stores them compactly and tests them in batches.
+// Emissive ones are left out, so that they can still be sampled as lights, and so are groups with only a few.
+static void GroupSpheres(std::vector<std::shared_ptr<Hittable>>& objects)
+{
+    const auto is_plain_sphere = [](const std::shared_ptr<Hittable>& object)
+    {
+        const Sphere* sphere = dynamic_cast<const Sphere*>(object.get());
+        return sphere && !sphere->IsEmissive();
+    };
+
+    std::vector<std::shared_ptr<Sphere>> spheres;
+    for (const auto& object : objects)
+    {
+        if (is_plain_sphere(object))
+            spheres.push_back(std::static_pointer_cast<Sphere>(object));
+    }
+
+    if (spheres.size() >= SphereSet::c_leafSize)
+    {
+        std::erase_if(objects, is_plain_sphere);
+        objects.push_back(std::make_shared<SphereSet>(spheres, GetObjectBuildOptions()));
+    }
+}
+
+
 // Scene deserialization
 void from_json(const json& j, Scene& s)
 {
     j.at("background").get_to<Color>(s.background);
     j.at("camera").get_to<Camera>(s.camera);
-    j.at("objects").get_to<std::vector<std::shared_ptr<Hittable>>>(s.objects);
+
+    // Geometry prototypes, each with its own BVH, are only loaded once and then placed in the scene by the objects of
+    // type "Instance" that reference them by name. Their hierarchies must hold for all the frames of an animation,
+    // which move the shutter interval forward by its length at every frame.
+    std::unordered_map<std::string, std::shared_ptr<Prototype>> prototypes;
+    if (j.contains("prototypes"))
+    {
+        const double t_start = s.camera.GetTimeShutterOpen();
+        const double shutter_length = s.camera.GetTimeShutterClose() - t_start;
+        const double t_end = t_start + shutter_length * std::max(RenderSettings::Get().FrameCount(), 1u);
+
+        for (const auto& [name, json_objects] : j.at("prototypes").items())
+        {
+            std::vector<std::shared_ptr<Hittable>> objects = json_objects.get<std::vector<std::shared_ptr<Hittable>>>();
+            if (objects.empty())
+                throw std::exception(("Empty prototype: " + name).c_str());
+
+            GroupSpheres(objects);
+            prototypes[name] = std::make_shared<Prototype>(std::move(objects), t_start, t_end, GetObjectBuildOptions());
+        }
+    }
+
+    for (const auto& json_object : j.at("objects"))
+    {
+        if (json_object.at("type") == "Instance")
+        {
+            const std::string name = json_object.at("prototype").get<std::string>();
+            const auto prototype = prototypes.find(name);
+            if (prototype == prototypes.end())
+                throw std::exception(("Unknown prototype: " + name).c_str());
+
+            const Transform transform = GetTransform(json_object);
+            if (transform.IsIdentity())
+                s.objects.push_back(prototype->second);
+            else
+                s.objects.push_back(std::make_shared<Instance>(prototype->second, transform));
+        }
+        else
+        {
+            s.objects.push_back(json_object.get<std::shared_ptr<Hittable>>());
+        }
+    }
+
+    GroupSpheres(s.objects);
+    s.CollectLights();
+
+    const auto collect_files = [&](const json& json_objects)
+    {
+        for (const auto& object : json_objects)
+        {
+            if (object.at("type") == "Mesh")
+                s.files.push_back(object.at("filename").get<std::string>());
+        }
+    };
+
+    collect_files(j.at("objects"));
+    if (j.contains("prototypes"))
+    {
+        for (const auto& [name, json_objects] : j.at("prototypes").items())
+            collect_files(json_objects);
+    }
 }
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <bit>
+#include <span>
+#include <cassert>
+#include <algorithm>
+
+#include "Common.h"
+#include "AABB.h"
+#include "NodeBVH.h"
+#include "Parallel.h"
+
+
+// Linear BVH builder (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees,
+// and k-d Trees", 2012): the primitives are sorted along a Morton curve through their centroids,
+// then every interior node of the hierarchy is found independently from the sorted codes.
+// An optional pass restructures small treelets of the result to lower its SAH cost
+// (Karras and Aila, "Fast Parallel Construction of High-Quality BVHs", 2013).
+class MortonBuilder
+{
+private:
+
+	static constexpr uint32_t c_leafFlag = 0x80000000u;		// Marks child references to sorted primitives
+	static constexpr int      c_treeletSize = 7;			// Maximum number of leaves in a treelet
+
+	// Interior node of the intermediate binary tree, which has one node less than the primitives.
+	struct TreeNode
+	{
+		uint32_t child[2];
+		AABB     box;
+		double   cost = 0.0;		// SAH cost of the sub-tree
+		uint32_t count = 0;			// Number of primitives in the sub-tree
+	};
+
+	struct Context
+	{
+		const BuildOptionsBVH&    options;
+		std::vector<uint32_t>     sorted;		// Primitive indices sorted by Morton code
+		std::vector<AABB>         leaf_boxes;	// Bounds of the sorted primitives
+		std::vector<TreeNode>     tree;
+
+		// Scratch space for the treelet optimization, one entry per subset of the treelet leaves
+		// (kept here rather than on the stack of the recursive visit).
+		std::vector<double>       subset_cost;
+		std::vector<uint32_t>     subset_split;
+		std::vector<AABB>         subset_box;
+
+		explicit Context(const BuildOptionsBVH& build_options) : options(build_options) {}
+	};
+
+public:
+
+	// Build the hierarchy over the given primitive bounds, writing the nodes in the same
+	// depth-first layout produced by the SAH builder.
+	static void Build(const std::vector<AABB>& bounds, const BuildOptionsBVH& options,
+		std::vector<NodeBVH>& nodes, std::vector<uint32_t>& primitives)
+	{
+		Context context(options);
+
+		// Large scenes use 63-bit codes (21 bits per axis), to avoid too many primitives
+		// ending up with the same code; smaller ones get by with 30-bit codes.
+		if (bounds.size() > (1u << 18))
+			BuildTree<uint64_t>(context, bounds);
+		else
+			BuildTree<uint32_t>(context, bounds);
+
+		if (bounds.size() > 1)
+		{
+			ComputeBounds(context, 0);
+
+			context.subset_cost.resize(1 << c_treeletSize);
+			context.subset_split.resize(1 << c_treeletSize);
+			context.subset_box.resize(1 << c_treeletSize);
+
+			for (uint32_t pass = 0; pass < options.treelet_passes; pass++)
+				OptimizeTreelets(context, 0);
+		}
+
+		nodes.clear();
+		primitives.clear();
+		nodes.reserve(2 * bounds.size() - 1);
+		primitives.reserve(bounds.size());
+
+		const uint32_t root = bounds.size() > 1 ? 0 : c_leafFlag;
+		Flatten(context, root, 0, nodes, primitives);
+	}
+
+private:
+
+	template <typename CodeT>
+	static void BuildTree(Context& context, const std::vector<AABB>& bounds)
+	{
+		const size_t count = bounds.size();
+		const uint32_t thread_count = context.options.thread_count;
+
+		AABB centroid_box = AABB::Empty();
+		for (const AABB& box : bounds)
+			centroid_box = AABB::Combine(centroid_box, box.Center());
+
+		// Quantize the centroids on a 2^bits grid over their bounding box, and compute their Morton codes.
+		constexpr int bits = (sizeof(CodeT) == 8) ? 21 : 10;
+		constexpr double grid = double((1u << bits) - 1);
+
+		std::vector<CodeT> codes(count);
+		context.sorted.resize(count);
+
+		ParallelFor(0, count, thread_count, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const Point3 c = bounds[i].Center();
+				CodeT code = 0;
+				for (int a = 0; a < 3; a++)
+				{
+					const double extent = centroid_box.max[a] - centroid_box.min[a];
+					const double t = extent > 0.0 ? (c[a] - centroid_box.min[a]) / extent : 0.5;
+					code |= ExpandBits<CodeT>(static_cast<CodeT>(Clamp(t, 0.0, 1.0) * grid)) << (2 - a);
+				}
+				codes[i] = code;
+				context.sorted[i] = static_cast<uint32_t>(i);
+			}
+		});
+
+		RadixSort(codes, context.sorted, thread_count);
+
+		context.leaf_boxes.resize(count);
+		for (size_t i = 0; i < count; i++)
+			context.leaf_boxes[i] = bounds[context.sorted[i]];
+
+		if (count < 2)
+			return;
+
+		// Every interior node covers a contiguous range of sorted primitives, which can be found
+		// (together with its split point) just by looking at the codes around its own index.
+		context.tree.resize(count - 1);
+
+		ParallelFor(0, count - 1, thread_count, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t n = begin; n < end; n++)
+			{
+				const int64_t i = static_cast<int64_t>(n);
+
+				// Direction of the range, towards the neighbor sharing the longest prefix.
+				const int d = (Delta(codes, i, i + 1) - Delta(codes, i, i - 1)) >= 0 ? 1 : -1;
+				const int delta_min = Delta(codes, i, i - d);
+
+				// Upper bound for the length of the range, then binary search for the other end.
+				int64_t l_max = 2;
+				while (Delta(codes, i, i + l_max * d) > delta_min)
+					l_max *= 2;
+
+				int64_t l = 0;
+				for (int64_t t = l_max / 2; t >= 1; t /= 2)
+				{
+					if (Delta(codes, i, i + (l + t) * d) > delta_min)
+						l += t;
+				}
+				const int64_t j = i + l * d;
+
+				// Binary search for the split position, where the common prefix of the range ends.
+				const int delta_node = Delta(codes, i, j);
+				int64_t s = 0;
+				for (int64_t t = (l + 1) / 2; ; t = (t + 1) / 2)
+				{
+					if (Delta(codes, i, i + (s + t) * d) > delta_node)
+						s += t;
+					if (t == 1)
+						break;
+				}
+				const int64_t gamma = i + s * d + std::min(d, 0);
+
+				TreeNode& node = context.tree[n];
+				node.child[0] = static_cast<uint32_t>(gamma) | (std::min(i, j) == gamma ? c_leafFlag : 0);
+				node.child[1] = static_cast<uint32_t>(gamma + 1) | (std::max(i, j) == gamma + 1 ? c_leafFlag : 0);
+			}
+		});
+	}
+
+
+	// Length of the common prefix between the codes of two sorted primitives,
+	// using their index to break ties between duplicate codes.
+	template <typename CodeT>
+	static int Delta(const std::vector<CodeT>& codes, const int64_t i, const int64_t j) noexcept
+	{
+		if (j < 0 || j >= static_cast<int64_t>(codes.size()))
+			return -1;
+
+		if (codes[i] == codes[j])
+			return int(8 * sizeof(CodeT)) + std::countl_zero(static_cast<uint32_t>(i ^ j));
+
+		return std::countl_zero(static_cast<CodeT>(codes[i] ^ codes[j]));
+	}
+
+	// Insert two zero bits between each of the lower bits of the value.
+	template <typename CodeT>
+	static CodeT ExpandBits(CodeT v) noexcept
+	{
+		if constexpr (sizeof(CodeT) == 8)
+		{
+			v &= 0x1FFFFF;
+			v = (v | v << 32) & 0x1F00000000FFFF;
+			v = (v | v << 16) & 0x1F0000FF0000FF;
+			v = (v | v << 8)  & 0x100F00F00F00F00F;
+			v = (v | v << 4)  & 0x10C30C30C30C30C3;
+			v = (v | v << 2)  & 0x1249249249249249;
+		}
+		else
+		{
+			v &= 0x3FF;
+			v = (v | v << 16) & 0x030000FF;
+			v = (v | v << 8)  & 0x0300F00F;
+			v = (v | v << 4)  & 0x030C30C3;
+			v = (v | v << 2)  & 0x09249249;
+		}
+		return v;
+	}
+
+
+	// Stable least-significant-digit radix sort of the keys (and their values), 8 bits per pass.
+	// Each thread histograms and then scatters its own contiguous chunk of the input.
+	template <typename KeyT>
+	static void RadixSort(std::vector<KeyT>& keys, std::vector<uint32_t>& values, uint32_t thread_count)
+	{
+		const size_t count = keys.size();
+		thread_count = static_cast<uint32_t>(std::clamp<size_t>(thread_count, 1, std::max<size_t>(count / 4096, 1)));
+
+		std::vector<KeyT> keys_temp(count);
+		std::vector<uint32_t> values_temp(count);
+		std::vector<std::array<size_t, 256>> offsets(thread_count);
+
+		for (int shift = 0; shift < int(8 * sizeof(KeyT)); shift += 8)
+		{
+			ParallelFor(0, count, thread_count, [&](size_t begin, size_t end, uint32_t t)
+			{
+				offsets[t].fill(0);
+				for (size_t i = begin; i < end; i++)
+					offsets[t][(keys[i] >> shift) & 0xFF]++;
+			});
+
+			// Turn the histograms into scatter offsets, ordered by digit first and then by chunk.
+			size_t sum = 0;
+			bool single_digit = false;
+			for (int digit = 0; digit < 256; digit++)
+			{
+				size_t digit_count = 0;
+				for (uint32_t t = 0; t < thread_count; t++)
+				{
+					const size_t c = offsets[t][digit];
+					offsets[t][digit] = sum;
+					sum += c;
+					digit_count += c;
+				}
+				single_digit |= (digit_count == count);
+			}
+
+			// Nothing to reorder if all the keys share the same digit in this pass.
+			if (single_digit)
+				continue;
+
+			ParallelFor(0, count, thread_count, [&](size_t begin, size_t end, uint32_t t)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const size_t destination = offsets[t][(keys[i] >> shift) & 0xFF]++;
+					keys_temp[destination] = keys[i];
+					values_temp[destination] = values[i];
+				}
+			});
+
+			keys.swap(keys_temp);
+			values.swap(values_temp);
+		}
+	}
+
+
+	static const AABB& GetBox(const Context& context, const uint32_t ref) noexcept
+	{
+		return (ref & c_leafFlag) ? context.leaf_boxes[ref & ~c_leafFlag] : context.tree[ref].box;
+	}
+
+	static double GetCost(const Context& context, const uint32_t ref) noexcept
+	{
+		return (ref & c_leafFlag) ? IntersectionCostSAH * context.leaf_boxes[ref & ~c_leafFlag].SurfaceArea() : context.tree[ref].cost;
+	}
+
+	static uint32_t GetCount(const Context& context, const uint32_t ref) noexcept
+	{
+		return (ref & c_leafFlag) ? 1 : context.tree[ref].count;
+	}
+
+	static void UpdateNode(Context& context, const uint32_t index) noexcept
+	{
+		TreeNode& node = context.tree[index];
+		node.box = AABB::Combine(GetBox(context, node.child[0]), GetBox(context, node.child[1]));
+		node.count = GetCount(context, node.child[0]) + GetCount(context, node.child[1]);
+		node.cost = TraversalCostSAH * node.box.SurfaceArea() + GetCost(context, node.child[0]) + GetCost(context, node.child[1]);
+	}
+
+	// Compute bounds, primitive counts and SAH costs of the interior nodes, bottom-up.
+	static void ComputeBounds(Context& context, const uint32_t index)
+	{
+		for (const uint32_t child : context.tree[index].child)
+		{
+			if (!(child & c_leafFlag))
+				ComputeBounds(context, child);
+		}
+		UpdateNode(context, index);
+	}
+
+
+	// Visit the tree bottom-up, replacing the treelet rooted at each interior node with
+	// its optimal topology (the one with the lowest SAH cost over the same leaves).
+	static void OptimizeTreelets(Context& context, const uint32_t index)
+	{
+		for (const uint32_t child : context.tree[index].child)
+		{
+			if (!(child & c_leafFlag))
+				OptimizeTreelets(context, child);
+		}
+		UpdateNode(context, index);
+
+		if (context.tree[index].count < c_treeletSize)
+			return;
+
+		// Grow the treelet from the root, by repeatedly turning its largest leaf into an interior node.
+		uint32_t leaves[c_treeletSize] = { context.tree[index].child[0], context.tree[index].child[1] };
+		uint32_t interiors[c_treeletSize - 1] = { index };
+		int leaf_count = 2;
+		int interior_count = 1;
+
+		while (leaf_count < c_treeletSize)
+		{
+			int largest = -1;
+			double largest_area = -1.0;
+			for (int i = 0; i < leaf_count; i++)
+			{
+				if (leaves[i] & c_leafFlag)
+					continue;
+
+				const double area = context.tree[leaves[i]].box.SurfaceArea();
+				if (area > largest_area)
+				{
+					largest_area = area;
+					largest = i;
+				}
+			}
+
+			if (largest < 0)
+				break;
+
+			const uint32_t opened = leaves[largest];
+			interiors[interior_count++] = opened;
+			leaves[largest] = context.tree[opened].child[0];
+			leaves[leaf_count++] = context.tree[opened].child[1];
+		}
+
+		// Dynamic programming over all the subsets of the treelet leaves, from the smallest
+		// ones up, finding the cheapest way of splitting each subset in two.
+		const uint32_t subsets = 1u << leaf_count;
+		double* cost = context.subset_cost.data();
+		uint32_t* split = context.subset_split.data();
+		AABB* boxes = context.subset_box.data();
+
+		for (uint32_t s = 1; s < subsets; s++)
+		{
+			boxes[s] = AABB::Empty();
+			for (int i = 0; i < leaf_count; i++)
+			{
+				if (s & (1u << i))
+					boxes[s] = AABB::Combine(boxes[s], GetBox(context, leaves[i]));
+			}
+		}
+
+		for (int i = 0; i < leaf_count; i++)
+			cost[1u << i] = GetCost(context, leaves[i]);
+
+		for (int size = 2; size <= leaf_count; size++)
+		{
+			for (uint32_t s = 1; s < subsets; s++)
+			{
+				if (std::popcount(s) != size)
+					continue;
+
+				// Only enumerate the partitions where the lowest leaf falls in the first half, to skip mirrored ones.
+				const uint32_t lowest = s & (~s + 1);
+				double best = Infinity;
+				uint32_t best_split = 0;
+				for (uint32_t p = (s - 1) & s; p != 0; p = (p - 1) & s)
+				{
+					if (!(p & lowest))
+						continue;
+
+					const double c = cost[p] + cost[s ^ p];
+					if (c < best)
+					{
+						best = c;
+						best_split = p;
+					}
+				}
+
+				cost[s] = TraversalCostSAH * boxes[s].SurfaceArea() + best;
+				split[s] = best_split;
+			}
+		}
+
+		// Only rewire the treelet if it is actually an improvement.
+		if (cost[subsets - 1] >= context.tree[index].cost * (1.0 - 1e-9))
+			return;
+
+		int next_interior = 0;
+		Rebuild(context, subsets - 1, split, leaves, interiors, next_interior);
+	}
+
+	static uint32_t Rebuild(Context& context, const uint32_t subset, const uint32_t* split,
+		const uint32_t* leaves, const uint32_t* interiors, int& next_interior)
+	{
+		if (std::popcount(subset) == 1)
+			return leaves[std::countr_zero(subset)];
+
+		// Interior nodes are reused in order, so that the treelet root stays in place.
+		const uint32_t index = interiors[next_interior++];
+		const uint32_t left = Rebuild(context, split[subset], split, leaves, interiors, next_interior);
+		const uint32_t right = Rebuild(context, subset ^ split[subset], split, leaves, interiors, next_interior);
+
+		context.tree[index].child[0] = left;
+		context.tree[index].child[1] = right;
+		UpdateNode(context, index);
+		return index;
+	}
+
+
+	// Write the sub-tree in depth-first order, collapsing small sub-trees into leaves when the SAH says so.
+	static uint32_t Flatten(const Context& context, const uint32_t ref, const int depth,
+		std::vector<NodeBVH>& nodes, std::vector<uint32_t>& primitives)
+	{
+		const uint32_t count = GetCount(context, ref);
+
+		// Equal Morton codes can make long chains of unbalanced nodes: a sub-tree whose children do not fit in the
+		// levels left before the depth limit is split evenly instead, so that the leaves there stay small enough.
+		if (!(ref & c_leafFlag) &&
+			std::max(GetCount(context, context.tree[ref].child[0]), GetCount(context, context.tree[ref].child[1])) > MaxSubtreeCountBVH(depth + 1))
+		{
+			std::vector<uint32_t> leaves;
+			leaves.reserve(count);
+			GatherLeaves(context, ref, leaves);
+			return FlattenEven(context, leaves, depth, nodes, primitives);
+		}
+
+		const uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+		nodes[index].SetBounds(GetBox(context, ref));
+
+		const bool collapse = !(ref & c_leafFlag) &&
+			((count <= context.options.max_leaf_size &&
+			  IntersectionCostSAH * count * GetBox(context, ref).SurfaceArea() <= GetCost(context, ref)) ||
+			 depth >= MaxDepthBVH - 1);
+
+		if ((ref & c_leafFlag) || collapse)
+		{
+			assert(count <= MaxLeafCountBVH);
+			nodes[index].offset = static_cast<uint32_t>(primitives.size());
+			nodes[index].count = static_cast<uint16_t>(count);
+			GatherPrimitives(context, ref, primitives);
+			return index;
+		}
+
+		uint32_t first = context.tree[ref].child[0];
+		uint32_t second = context.tree[ref].child[1];
+		const int axis = OrderChildren(GetBox(context, first), GetBox(context, second), first, second);
+
+		Flatten(context, first, depth + 1, nodes, primitives);
+		const uint32_t second_child = Flatten(context, second, depth + 1, nodes, primitives);
+
+		nodes[index].offset = second_child;
+		nodes[index].count = 0;
+		nodes[index].axis = static_cast<uint8_t>(axis);
+		return index;
+	}
+
+	// Write a balanced sub-tree over the given sorted primitives, halving them along the Morton curve at every level.
+	static uint32_t FlattenEven(const Context& context, const std::span<const uint32_t> leaves, const int depth,
+		std::vector<NodeBVH>& nodes, std::vector<uint32_t>& primitives)
+	{
+		const auto get_box = [&](const std::span<const uint32_t> range)
+		{
+			AABB box = AABB::Empty();
+			for (const uint32_t leaf : range)
+				box = AABB::Combine(box, context.leaf_boxes[leaf]);
+			return box;
+		};
+
+		const uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+		nodes[index].SetBounds(get_box(leaves));
+
+		const uint32_t count = static_cast<uint32_t>(leaves.size());
+		if (count <= context.options.max_leaf_size || depth >= MaxDepthBVH - 1)
+		{
+			assert(count <= MaxLeafCountBVH);
+			nodes[index].offset = static_cast<uint32_t>(primitives.size());
+			nodes[index].count = static_cast<uint16_t>(count);
+			for (const uint32_t leaf : leaves)
+				primitives.push_back(context.sorted[leaf]);
+			return index;
+		}
+
+		std::span<const uint32_t> first = leaves.first(count / 2);
+		std::span<const uint32_t> second = leaves.subspan(count / 2);
+		const int axis = OrderChildren(get_box(first), get_box(second), first, second);
+
+		FlattenEven(context, first, depth + 1, nodes, primitives);
+		const uint32_t second_child = FlattenEven(context, second, depth + 1, nodes, primitives);
+
+		nodes[index].offset = second_child;
+		nodes[index].count = 0;
+		nodes[index].axis = static_cast<uint8_t>(axis);
+		return index;
+	}
+
+	// Order the children along the axis where their centers are furthest apart, returning that axis,
+	// so that the traversal can visit the nearest one first.
+	template <typename ChildT>
+	static int OrderChildren(const AABB& first_box, const AABB& second_box, ChildT& first, ChildT& second) noexcept
+	{
+		const Vector3 distance = second_box.Center() - first_box.Center();
+
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+		{
+			if (std::fabs(distance[a]) > std::fabs(distance[axis]))
+				axis = a;
+		}
+		if (distance[axis] < 0.0)
+			std::swap(first, second);
+
+		return axis;
+	}
+
+	// Collect the positions in the sorted order of the primitives in the sub-tree.
+	static void GatherLeaves(const Context& context, const uint32_t ref, std::vector<uint32_t>& leaves)
+	{
+		if (ref & c_leafFlag)
+		{
+			leaves.push_back(ref & ~c_leafFlag);
+			return;
+		}
+
+		GatherLeaves(context, context.tree[ref].child[0], leaves);
+		GatherLeaves(context, context.tree[ref].child[1], leaves);
+	}
+
+	static void GatherPrimitives(const Context& context, const uint32_t ref, std::vector<uint32_t>& primitives)
+	{
+		if (ref & c_leafFlag)
+		{
+			primitives.push_back(context.sorted[ref & ~c_leafFlag]);
+			return;
+		}
+
+		GatherPrimitives(context, context.tree[ref].child[0], primitives);
+		GatherPrimitives(context, context.tree[ref].child[1], primitives);
+	}
+};
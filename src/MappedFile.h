@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Common.h"
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+
+// Read-only view of a whole file mapped in memory, which stays valid for the lifetime of the object.
+// The pages are loaded lazily by the operating system, and shared with any other process mapping the same file.
+class MappedFile
+{
+private:
+
+    const uint8_t* m_data = nullptr;
+    size_t         m_size = 0;
+
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+
+public:
+
+    // Map the file at the given path, returning nullptr if it does not exist or cannot be mapped.
+    static std::shared_ptr<const MappedFile> Open(const std::string& path)
+    {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+        return file->Map(path) ? file : nullptr;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+        if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+    }
+
+    const uint8_t* Data() const noexcept { return m_data; }
+    size_t         Size() const noexcept { return m_size; }
+
+private:
+
+    MappedFile() = default;
+
+    bool Map(const std::string& path)
+    {
+#if defined(_WIN32)
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return false;
+
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping)
+            return false;
+
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_size = static_cast<size_t>(size.QuadPart);
+        return m_data != nullptr;
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        // The mapping keeps its own reference to the file, which can be closed right away.
+        void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+
+        m_data = static_cast<const uint8_t*>(data);
+        m_size = static_cast<size_t>(info.st_size);
+        return true;
+#endif
+    }
+};
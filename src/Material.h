@@ -2,6 +2,7 @@
 
 #include "Common.h"
 #include "Texture.h"
+#include "ONB.h"
 
 
 // Defines an abstract common interface for all materials.
@@ -14,8 +15,21 @@ public:
 	virtual Color Emitted([[maybe_unused]] const Ray& ray_in, [[maybe_unused]] const HitRecord& hit)
 		const noexcept { return Color(0, 0, 0); }
 
+	// Sample a scattered ray, returning as attenuation the ratio between Evaluate() and ScatteringPdf() along it
+	// (or simply the fraction of light reflected by specular materials, which have no density).
 	virtual bool Scatter(const Ray& ray_in, const HitRecord& hit, Color& attenuation, Ray& ray_scattered) 
 		const noexcept = 0;
+
+	// Evaluate the BSDF times the cosine with the normal, for light arriving from the given direction.
+	// This is zero for specular materials, as the chance of any given direction being reflected is zero.
+	virtual Color Evaluate([[maybe_unused]] const Ray& ray_in, [[maybe_unused]] const HitRecord& hit, [[maybe_unused]] const Vector3& direction)
+		const noexcept { return Color(0, 0, 0); }
+
+	// Probability density, per unit solid angle, of Scatter() picking the given direction, which is zero for specular materials.
+	virtual double ScatteringPdf([[maybe_unused]] const Ray& ray_in, [[maybe_unused]] const HitRecord& hit, [[maybe_unused]] const Vector3& direction)
+		const noexcept { return 0.0; }
+
+	virtual bool IsEmissive() const noexcept { return false; }
 };
 
 
@@ -33,18 +47,26 @@ public:
 	virtual bool Scatter(const Ray& ray_in, const HitRecord& hit, Color& attenuation, Ray& ray_scattered)
 		const noexcept override final
 	{
-		// Scatter the incoming ray in a random direction off the surface
-		// (offset by the face normal to avoid rays going inside the surface).
-		Vector3 scatter_direction = hit.normal + Random::GetUnitVector();
-
-		// Catch potentially degenerate scatter direction.
-		if (scatter_direction.NearZero())
-			scatter_direction = hit.normal;
-
-		ray_scattered = Ray(hit.point, scatter_direction, ray_in.time);
+		// Scatter the incoming ray in a random direction off the surface, with a cosine distribution around
+		// the normal, for which the BSDF (albedo / PI) times the cosine divided by the density is just the albedo.
+		ray_scattered = Ray(hit.point, ONB(hit.normal).Local(Random::GetCosineDirection()), ray_in.time);
 		attenuation = albedo;
 		return true;
 	}
+
+	virtual Color Evaluate(const Ray& /*ray_in*/, const HitRecord& hit, const Vector3& direction)
+		const noexcept override final
+	{
+		const double cosine = Vector3::Dot(hit.normal, Vector3::Normalized(direction));
+		return cosine > 0.0 ? albedo * (cosine / PI) : Color(0, 0, 0);
+	}
+
+	virtual double ScatteringPdf(const Ray& /*ray_in*/, const HitRecord& hit, const Vector3& direction)
+		const noexcept override final
+	{
+		const double cosine = Vector3::Dot(hit.normal, Vector3::Normalized(direction));
+		return cosine > 0.0 ? cosine / PI : 0.0;
+	}
 };
 
 
@@ -62,18 +84,26 @@ public:
 	virtual bool Scatter(const Ray& ray_in, const HitRecord& hit, Color& attenuation, Ray& ray_scattered)
 		const noexcept override final
 	{
-		// Scatter the incoming ray in a random direction off the surface
-		// (offset by the face normal to avoid rays going inside the surface).
-		Vector3 scatter_direction = hit.normal + Random::GetUnitVector();
-
-		// Catch potentially degenerate scatter direction.
-		if (scatter_direction.NearZero())
-			scatter_direction = hit.normal;
-
-		ray_scattered = Ray(hit.point, scatter_direction, ray_in.time);
+		// Scatter the incoming ray in a random direction off the surface, with a cosine distribution around
+		// the normal, for which the BSDF (albedo / PI) times the cosine divided by the density is just the albedo.
+		ray_scattered = Ray(hit.point, ONB(hit.normal).Local(Random::GetCosineDirection()), ray_in.time);
 		attenuation = albedo->Sample(hit.u, hit.v, hit.point);
 		return true;
 	}
+
+	virtual Color Evaluate(const Ray& /*ray_in*/, const HitRecord& hit, const Vector3& direction)
+		const noexcept override final
+	{
+		const double cosine = Vector3::Dot(hit.normal, Vector3::Normalized(direction));
+		return cosine > 0.0 ? albedo->Sample(hit.u, hit.v, hit.point) * (cosine / PI) : Color(0, 0, 0);
+	}
+
+	virtual double ScatteringPdf(const Ray& /*ray_in*/, const HitRecord& hit, const Vector3& direction)
+		const noexcept override final
+	{
+		const double cosine = Vector3::Dot(hit.normal, Vector3::Normalized(direction));
+		return cosine > 0.0 ? cosine / PI : 0.0;
+	}
 };
 
 
@@ -184,6 +214,11 @@ public:
 	{
 		return false;
 	}
+
+	virtual bool IsEmissive() const noexcept override final
+	{
+		return true;
+	}
 };
 
 
@@ -202,8 +237,20 @@ public:
 		const noexcept override final
 	{
 		// An isotropic material's scattering function picks a uniformly random direction
-		ray_scattered = Ray(hit.point, Random::GetVectorInUnitSphere(), ray_in.time);
+		ray_scattered = Ray(hit.point, Random::GetUnitVector(), ray_in.time);
 		attenuation = color;
 		return true;
 	}
+
+	virtual Color Evaluate(const Ray& /*ray_in*/, const HitRecord& /*hit*/, const Vector3& /*direction*/)
+		const noexcept override final
+	{
+		return color / (4.0 * PI);
+	}
+
+	virtual double ScatteringPdf(const Ray& /*ray_in*/, const HitRecord& /*hit*/, const Vector3& /*direction*/)
+		const noexcept override final
+	{
+		return 1.0 / (4.0 * PI);
+	}
 };
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+
+#include "Common.h"
+#include "Hittable.h"
+#include "Material.h"
+#include "BVHCache.h"
+#include "WideBVH.h"
+
+
+// Geometry of an indexed triangle mesh: the vertex attributes are stored in separate arrays, all indexed by the
+// same vertex index, and the normals and texture coordinates are optional (empty when the mesh has none).
+struct MeshData
+{
+	std::vector<Point3>   positions;
+	std::vector<Vector3>  normals;
+	std::vector<double>   uvs;			// Two coordinates per vertex
+	std::vector<uint32_t> indices;		// Three vertices per triangle
+};
+
+
+// Triangle mesh, intersected through its own BVH: the whole mesh is a single object of the scene,
+// so that even millions of triangles cost just their vertex indices and the nodes above them.
+class Mesh : public Hittable
+{
+private:
+
+	MeshData                  m_data;
+	std::shared_ptr<Material> m_material;
+	TraversalBVH              m_bvh;
+	AABB                      m_bounds;
+	std::vector<double>       m_areas;			// Cumulative areas of the triangles, only used for light sampling
+
+	// Ray transformed for the watertight triangle test: the axis along which the ray direction is
+	// largest becomes Z, and the direction is sheared so that it points straight along it.
+	struct ShearedRay
+	{
+		Point3 origin;
+		int    kx, ky, kz;
+		double sx, sy, sz;
+
+		explicit ShearedRay(const Ray& ray) noexcept
+			: origin(ray.origin)
+		{
+			const Vector3& d = ray.direction;
+			kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2) : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+
+			// Swap the other two axes when the direction is negative, to preserve the winding of the triangles.
+			if (d[kz] < 0.0)
+				std::swap(kx, ky);
+
+			sx = d[kx] / d[kz];
+			sy = d[ky] / d[kz];
+			sz = 1.0 / d[kz];
+		}
+	};
+
+public:
+
+	Mesh(MeshData data, std::shared_ptr<Material> material, const BuildOptionsBVH& options = {})
+		: m_data(std::move(data)), m_material(material), m_bounds(AABB::Empty())
+	{
+		const uint32_t triangle_count = GetTriangleCount();
+
+		std::vector<AABB> bounds(triangle_count);
+		ParallelFor(0, triangle_count, options.thread_count, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const uint32_t* v = &m_data.indices[i * 3];
+				bounds[i] = AABB::Combine(AABB::Combine(AABB(m_data.positions[v[0]], m_data.positions[v[0]]),
+					m_data.positions[v[1]]), m_data.positions[v[2]]);
+			}
+		});
+
+		for (const AABB& box : bounds)
+			m_bounds = AABB::Combine(m_bounds, box);
+
+		BVHCache::BuildObject(m_bvh.GetBVH(), bounds, options);
+		m_bvh.Collapse(options.width);
+
+		if (m_material->IsEmissive())
+		{
+			m_areas.resize(triangle_count);
+			double area = 0.0;
+			for (uint32_t i = 0; i < triangle_count; i++)
+			{
+				area += 0.5 * Vector3::Cross(Edge(i, 1), Edge(i, 2)).Length();
+				m_areas[i] = area;
+			}
+
+			// A mesh without any area cannot be sampled, but it can still be hit.
+			if (area <= 0.0)
+				m_areas.clear();
+		}
+	}
+
+
+	uint32_t GetTriangleCount() const noexcept
+	{
+		return static_cast<uint32_t>(m_data.indices.size() / 3);
+	}
+
+
+	// Ray-mesh intersection checking, recording the triangle hit as the primitive.
+	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
+		const noexcept override final
+	{
+		const ShearedRay sheared(ray);
+
+		return m_bvh.Hit(ray, t_min, t_max, [&](const uint32_t triangle, const double t_lower, double& t_closest)
+		{
+			double t, b0, b1, b2;
+			if (!IntersectTriangle(sheared, triangle, t, b0, b1, b2) || t <= t_lower || t >= t_closest)
+				return false;
+
+			t_closest = t;
+			hit.t = t;
+			hit.object = this;
+			hit.primitive_id = triangle;
+			return true;
+		});
+	}
+
+
+	// The barycentric coordinates of the hit are recomputed here, only for the closest triangle,
+	// and used to interpolate the vertex normals and texture coordinates (when present).
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
+		const uint32_t* v = &m_data.indices[size_t(hit.primitive_id) * 3];
+
+		double t, b0, b1, b2;
+		IntersectTriangle(ShearedRay(ray), hit.primitive_id, t, b0, b1, b2);
+
+		hit.point = ray.At(hit.t);
+
+		const Vector3 geometric_normal = Vector3::Normalized(Vector3::Cross(Edge(hit.primitive_id, 1), Edge(hit.primitive_id, 2)));
+		hit.is_front_face = Vector3::Dot(ray.direction, geometric_normal) < 0.0;
+		const Vector3 outward_normal = hit.is_front_face ? geometric_normal : -geometric_normal;
+
+		// Interpolated normals are flipped to the side of the geometric one facing the ray.
+		if (!m_data.normals.empty())
+		{
+			const Vector3 normal = Vector3::Normalized(b0 * m_data.normals[v[0]] + b1 * m_data.normals[v[1]] + b2 * m_data.normals[v[2]]);
+			hit.normal = Vector3::Dot(normal, outward_normal) < 0.0 ? -normal : normal;
+		}
+		else
+		{
+			hit.normal = outward_normal;
+		}
+
+		if (!m_data.uvs.empty())
+		{
+			hit.u = b0 * m_data.uvs[v[0] * 2] + b1 * m_data.uvs[v[1] * 2] + b2 * m_data.uvs[v[2] * 2];
+			hit.v = b0 * m_data.uvs[v[0] * 2 + 1] + b1 * m_data.uvs[v[1] * 2 + 1] + b2 * m_data.uvs[v[2] * 2 + 1];
+		}
+		else
+		{
+			hit.u = b1;
+			hit.v = b2;
+		}
+
+		hit.material = m_material.get();
+	}
+
+
+	// Mesh bounding box.
+	virtual bool BoundingBox(const double /*t_start*/, const double /*t_end*/, AABB& box)
+		const noexcept override final
+	{
+		box = m_bounds;
+		return GetTriangleCount() > 0;
+	}
+
+
+	virtual bool IsEmissive() const noexcept override final
+	{
+		return !m_areas.empty();
+	}
+
+
+	// Solid angle density of the directions towards points uniformly distributed on the surface of the mesh. A direction
+	// can cross the mesh several times, and reach any of these points when sampled, so their densities add up.
+	virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
+		const noexcept override final
+	{
+		const Ray ray(origin, direction, time);
+		const ShearedRay sheared(ray);
+		const double sqr_length = direction.SqrLength();
+		double pdf = 0.0;
+
+		// Never report a hit, so that the traversal goes on through all the triangles along the ray.
+		m_bvh.Hit(ray, 0.001, Infinity, [&](const uint32_t triangle, const double t_lower, double&)
+		{
+			double t, b0, b1, b2;
+			if (IntersectTriangle(sheared, triangle, t, b0, b1, b2) && t > t_lower)
+			{
+				const Vector3 normal = Vector3::Cross(Edge(triangle, 1), Edge(triangle, 2));
+				const double cosine = std::fabs(Vector3::Dot(direction, normal)) / std::sqrt(sqr_length * normal.SqrLength());
+				pdf += t * t * sqr_length / cosine;
+			}
+			return false;
+		});
+
+		return pdf / m_areas.back();
+	}
+
+
+	// Pick a triangle with a probability proportional to its area, and a uniformly distributed point on it.
+	// The same random number selects the triangle and then, rescaled to its range, the first coordinate.
+	virtual Vector3 SampleDirection(const Point3& origin, const double /*time*/)
+		const noexcept override final
+	{
+		const double total = m_areas.back();
+		double u = Random::GetDouble(0.0, 1.0) * total;
+		const double w = Random::GetDouble(0.0, 1.0);
+
+		const uint32_t triangle = static_cast<uint32_t>(std::min<size_t>(
+			std::upper_bound(m_areas.begin(), m_areas.end(), u) - m_areas.begin(), m_areas.size() - 1));
+		const double start = triangle > 0 ? m_areas[triangle - 1] : 0.0;
+		u = Clamp((u - start) / (m_areas[triangle] - start), 0.0, 1.0);
+
+		const double s = std::sqrt(u);
+		const Point3 p = m_data.positions[m_data.indices[size_t(triangle) * 3]] + s * (1.0 - w) * Edge(triangle, 1) + s * w * Edge(triangle, 2);
+		return p - origin;
+	}
+
+private:
+
+	// Edge from the first vertex of a triangle to the second or the third one.
+	Vector3 Edge(const uint32_t triangle, const int vertex) const noexcept
+	{
+		const uint32_t* v = &m_data.indices[size_t(triangle) * 3];
+		return m_data.positions[v[vertex]] - m_data.positions[v[0]];
+	}
+
+	// Watertight ray-triangle intersection (Woop et al., "Watertight Ray/Triangle Intersection"): the edge tests
+	// are done in the sheared space of the ray, where they are exactly consistent between neighboring triangles,
+	// so that rays never slip through their shared edges. Outputs the distance and the barycentric coordinates.
+	bool IntersectTriangle(const ShearedRay& ray, const uint32_t triangle, double& t, double& b0, double& b1, double& b2) const noexcept
+	{
+		const uint32_t* vertices = &m_data.indices[size_t(triangle) * 3];
+		const Vector3 a = m_data.positions[vertices[0]] - ray.origin;
+		const Vector3 b = m_data.positions[vertices[1]] - ray.origin;
+		const Vector3 c = m_data.positions[vertices[2]] - ray.origin;
+
+		const double ax = a[ray.kx] - ray.sx * a[ray.kz];
+		const double ay = a[ray.ky] - ray.sy * a[ray.kz];
+		const double bx = b[ray.kx] - ray.sx * b[ray.kz];
+		const double by = b[ray.ky] - ray.sy * b[ray.kz];
+		const double cx = c[ray.kx] - ray.sx * c[ray.kz];
+		const double cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+		// Scaled barycentric coordinates, which must all have the same sign for the ray to pass inside the triangle.
+		const double u = EdgeFunction(bx, by, cx, cy);
+		const double v = EdgeFunction(cx, cy, ax, ay);
+		const double w = EdgeFunction(ax, ay, bx, by);
+
+		if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+			return false;
+
+		const double det = u + v + w;
+		if (det == 0.0)
+			return false;
+
+		const double inv_det = 1.0 / det;
+		t = (u * ray.sz * a[ray.kz] + v * ray.sz * b[ray.kz] + w * ray.sz * c[ray.kz]) * inv_det;
+		b0 = u * inv_det;
+		b1 = v * inv_det;
+		b2 = w * inv_det;
+		return true;
+	}
+
+	// Edge function of the segment from p to q, always evaluated with its endpoints in the same order: both the triangles
+	// sharing an edge then compute exactly opposite values for it, even if the compiler fuses the products into
+	// multiply-adds (which round them differently depending on the order), so that no ray can slip between them.
+	static double EdgeFunction(const double px, const double py, const double qx, const double qy) noexcept
+	{
+		if (px < qx || (px == qx && py < qy))
+			return qx * py - qy * px;
+		return -(px * qy - py * qx);
+	}
+};
@@ -0,0 +1,426 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <string_view>
+#include <unordered_map>
+
+#include "Common.h"
+#include "Mesh.h"
+
+
+// Reads triangle meshes from Wavefront OBJ and binary PLY files. Polygons are split into triangle fans,
+// and vertex normals and texture coordinates are kept only if every vertex of the mesh has them.
+class MeshLoader
+{
+public:
+
+	// Load a mesh, picking the file format from the extension (.obj or .ply).
+	static MeshData Load(const std::string& path)
+	{
+		const size_t dot = path.find_last_of('.');
+		std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](const char c) { return static_cast<char>(std::tolower(c)); });
+
+		MeshData data;
+		if (extension == "obj")
+			data = LoadOBJ(ReadFile(path));
+		else if (extension == "ply")
+			data = LoadPLY(ReadFile(path));
+		else
+			throw std::exception(("Unsupported mesh file format: " + path).c_str());
+
+		if (!IsValid(data))
+			throw std::exception(("Invalid mesh file: " + path).c_str());
+
+		return data;
+	}
+
+private:
+
+	static std::string ReadFile(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		if (!file.is_open() || file.bad())
+			throw std::exception(("Could not open mesh file: " + path).c_str());
+
+		return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	}
+
+	static bool IsValid(const MeshData& data) noexcept
+	{
+		if (data.indices.empty() || data.indices.size() % 3 != 0)
+			return false;
+		if (!data.normals.empty() && data.normals.size() != data.positions.size())
+			return false;
+		if (!data.uvs.empty() && data.uvs.size() != data.positions.size() * 2)
+			return false;
+
+		return std::all_of(data.indices.begin(), data.indices.end(), [&](const uint32_t i) { return i < data.positions.size(); });
+	}
+
+
+	// ---- Wavefront OBJ ----
+
+	// Indices of the position, texture coordinates and normal of a face vertex (0 = missing).
+	struct VertexOBJ
+	{
+		uint32_t position = 0;
+		uint32_t uv = 0;
+		uint32_t normal = 0;
+
+		bool operator==(const VertexOBJ& other) const noexcept
+		{
+			return position == other.position && uv == other.uv && normal == other.normal;
+		}
+	};
+
+	struct VertexHashOBJ
+	{
+		size_t operator()(const VertexOBJ& v) const noexcept
+		{
+			return (size_t(v.position) * 73856093u) ^ (size_t(v.uv) * 19349663u) ^ (size_t(v.normal) * 83492791u);
+		}
+	};
+
+	static MeshData LoadOBJ(const std::string& text)
+	{
+		std::vector<Point3>    positions;
+		std::vector<Vector3>   normals;
+		std::vector<double>    uvs;
+		std::vector<VertexOBJ> corners;			// Three per triangle
+		std::vector<VertexOBJ> polygon;
+
+		const char* cursor = text.data();
+		const char* const end = text.data() + text.size();
+
+		while (cursor < end)
+		{
+			const char* const line_end = std::find(cursor, end, '\n');
+			SkipSpaces(cursor, line_end);
+
+			if (StartsWith(cursor, line_end, "v "))
+			{
+				cursor += 2;
+				const double x = ReadDouble(cursor, line_end);
+				const double y = ReadDouble(cursor, line_end);
+				const double z = ReadDouble(cursor, line_end);
+				positions.emplace_back(x, y, z);
+			}
+			else if (StartsWith(cursor, line_end, "vn "))
+			{
+				cursor += 3;
+				const double x = ReadDouble(cursor, line_end);
+				const double y = ReadDouble(cursor, line_end);
+				const double z = ReadDouble(cursor, line_end);
+				normals.emplace_back(x, y, z);
+			}
+			else if (StartsWith(cursor, line_end, "vt "))
+			{
+				cursor += 3;
+				uvs.push_back(ReadDouble(cursor, line_end));
+				uvs.push_back(ReadDouble(cursor, line_end));
+			}
+			else if (StartsWith(cursor, line_end, "f "))
+			{
+				cursor += 2;
+				polygon.clear();
+				SkipSpaces(cursor, line_end);
+				while (cursor < line_end && !std::isspace(static_cast<unsigned char>(*cursor)))
+				{
+					// Each vertex is "p", "p/t", "p//n" or "p/t/n", with negative indices relative to the end of the lists.
+					VertexOBJ vertex;
+					vertex.position = ReadIndexOBJ(cursor, line_end, positions.size());
+					if (cursor < line_end && *cursor == '/')
+					{
+						cursor++;
+						if (cursor < line_end && *cursor != '/')
+							vertex.uv = ReadIndexOBJ(cursor, line_end, uvs.size() / 2);
+						if (cursor < line_end && *cursor == '/')
+						{
+							cursor++;
+							vertex.normal = ReadIndexOBJ(cursor, line_end, normals.size());
+						}
+					}
+					polygon.push_back(vertex);
+					SkipSpaces(cursor, line_end);
+				}
+
+				for (size_t i = 2; i < polygon.size(); i++)
+					corners.insert(corners.end(), { polygon[0], polygon[i - 1], polygon[i] });
+			}
+
+			cursor = line_end + (line_end < end ? 1 : 0);
+		}
+
+		const bool has_uvs = std::all_of(corners.begin(), corners.end(), [](const VertexOBJ& v) { return v.uv != 0; });
+		const bool has_normals = std::all_of(corners.begin(), corners.end(), [](const VertexOBJ& v) { return v.normal != 0; });
+
+		// Merge the attributes of each distinct combination of indices into a single mesh vertex.
+		MeshData data;
+		data.indices.reserve(corners.size());
+		std::unordered_map<VertexOBJ, uint32_t, VertexHashOBJ> vertices;
+
+		for (VertexOBJ corner : corners)
+		{
+			if (!has_uvs)
+				corner.uv = 0;
+			if (!has_normals)
+				corner.normal = 0;
+
+			const auto [it, inserted] = vertices.try_emplace(corner, static_cast<uint32_t>(data.positions.size()));
+			if (inserted)
+			{
+				if (corner.position == 0 || corner.position > positions.size() || corner.uv * 2 > uvs.size() || corner.normal > normals.size())
+					throw std::exception("OBJ face references a missing vertex");
+
+				data.positions.push_back(positions[corner.position - 1]);
+				if (has_normals)
+					data.normals.push_back(Vector3::Normalized(normals[corner.normal - 1]));
+				if (has_uvs)
+					data.uvs.insert(data.uvs.end(), { uvs[(corner.uv - 1) * 2], uvs[(corner.uv - 1) * 2 + 1] });
+			}
+			data.indices.push_back(it->second);
+		}
+
+		return data;
+	}
+
+	// Read a 1-based index, turning negative (relative) ones into absolute, and returning 0 if invalid.
+	static uint32_t ReadIndexOBJ(const char*& cursor, const char* end, const size_t count)
+	{
+		long long index = 0;
+		const auto result = std::from_chars(cursor, end, index);
+		if (result.ec != std::errc())
+			throw std::exception("OBJ face has an invalid vertex index");
+
+		cursor = result.ptr;
+		if (index < 0)
+			index += static_cast<long long>(count) + 1;
+		return index > 0 && index <= std::numeric_limits<uint32_t>::max() ? static_cast<uint32_t>(index) : 0;
+	}
+
+	static void SkipSpaces(const char*& cursor, const char* end) noexcept
+	{
+		while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+			cursor++;
+	}
+
+	static bool StartsWith(const char* cursor, const char* end, const std::string_view prefix) noexcept
+	{
+		return static_cast<size_t>(end - cursor) >= prefix.size() && std::string_view(cursor, prefix.size()) == prefix;
+	}
+
+	static double ReadDouble(const char*& cursor, const char* end)
+	{
+		SkipSpaces(cursor, end);
+		double value = 0.0;
+		const auto result = std::from_chars(cursor, end, value);
+		if (result.ec != std::errc())
+			throw std::exception("OBJ file has an invalid number");
+
+		cursor = result.ptr;
+		return value;
+	}
+
+
+	// ---- Binary PLY ----
+
+	enum class TypePLY { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+	struct PropertyPLY
+	{
+		std::string name;
+		TypePLY     type = TypePLY::Float32;
+		bool        is_list = false;
+		TypePLY     count_type = TypePLY::UInt8;		// Type of the number of items of a list
+	};
+
+	struct ElementPLY
+	{
+		std::string              name;
+		size_t                   count = 0;
+		std::vector<PropertyPLY> properties;
+	};
+
+	// Sequential reader of the binary body of a PLY file.
+	struct ReaderPLY
+	{
+		const char* cursor;
+		const char* end;
+		bool        big_endian;
+
+		double Read(const TypePLY type)
+		{
+			switch (type)
+			{
+				case TypePLY::Int8:    return Read<int8_t>();
+				case TypePLY::UInt8:   return Read<uint8_t>();
+				case TypePLY::Int16:   return Read<int16_t>();
+				case TypePLY::UInt16:  return Read<uint16_t>();
+				case TypePLY::Int32:   return Read<int32_t>();
+				case TypePLY::UInt32:  return Read<uint32_t>();
+				case TypePLY::Float32: return Read<float>();
+				default:               return Read<double>();
+			}
+		}
+
+		template <typename T>
+		T Read()
+		{
+			if (static_cast<size_t>(end - cursor) < sizeof(T))
+				throw std::exception("PLY file is truncated");
+
+			char bytes[sizeof(T)];
+			std::memcpy(bytes, cursor, sizeof(T));
+			if (big_endian)
+				std::reverse(bytes, bytes + sizeof(T));
+			cursor += sizeof(T);
+
+			T value;
+			std::memcpy(&value, bytes, sizeof(T));
+			return value;
+		}
+	};
+
+	static MeshData LoadPLY(const std::string& text)
+	{
+		// The header is made of text lines, up to "end_header".
+		const size_t header_end = text.find("end_header");
+		const size_t body_start = header_end == std::string::npos ? std::string::npos : text.find('\n', header_end);
+		if (text.compare(0, 3, "ply") != 0 || body_start == std::string::npos)
+			throw std::exception("not a valid PLY file");
+
+		std::vector<ElementPLY> elements;
+		bool big_endian = false;
+
+		std::istringstream header(text.substr(0, header_end));
+		std::string line;
+		while (std::getline(header, line))
+		{
+			std::istringstream words(line);
+			std::string keyword;
+			words >> keyword;
+
+			if (keyword == "format")
+			{
+				std::string format;
+				words >> format;
+				if (format == "binary_big_endian")
+					big_endian = true;
+				else if (format != "binary_little_endian")
+					throw std::exception(("Unsupported PLY format: " + format).c_str());
+			}
+			else if (keyword == "element")
+			{
+				ElementPLY element;
+				words >> element.name >> element.count;
+				elements.push_back(element);
+			}
+			else if (keyword == "property" && !elements.empty())
+			{
+				PropertyPLY property;
+				std::string type;
+				words >> type;
+				if (type == "list")
+				{
+					std::string count_type;
+					words >> count_type >> type;
+					property.is_list = true;
+					property.count_type = ParseTypePLY(count_type);
+				}
+				property.type = ParseTypePLY(type);
+				words >> property.name;
+				elements.back().properties.push_back(property);
+			}
+		}
+
+		MeshData data;
+		ReaderPLY reader = { text.data() + body_start + 1, text.data() + text.size(), big_endian };
+
+		for (const ElementPLY& element : elements)
+		{
+			// Map the vertex properties to the attributes (-1 = ignored), accepting the usual names of the UVs.
+			std::vector<int> attributes(element.properties.size(), -1);
+			bool has_normals = false, has_uvs = false;
+			if (element.name == "vertex")
+			{
+				const char* names[] = { "x", "y", "z", "nx", "ny", "nz", "u", "v", "s", "t", "texture_u", "texture_v", "texture_s", "texture_t" };
+				for (size_t p = 0; p < element.properties.size(); p++)
+				{
+					for (int a = 0; a < 14; a++)
+					{
+						if (element.properties[p].name == names[a] && !element.properties[p].is_list)
+							attributes[p] = a < 6 ? a : 6 + (a - 6) % 2;
+					}
+					has_normals |= attributes[p] >= 3 && attributes[p] < 6;
+					has_uvs |= attributes[p] >= 6;
+				}
+
+				data.positions.reserve(element.count);
+				if (has_normals)
+					data.normals.reserve(element.count);
+				if (has_uvs)
+					data.uvs.reserve(element.count * 2);
+			}
+
+			std::vector<uint32_t> polygon;
+			for (size_t i = 0; i < element.count; i++)
+			{
+				double values[8] = {};
+				for (size_t p = 0; p < element.properties.size(); p++)
+				{
+					const PropertyPLY& property = element.properties[p];
+					if (!property.is_list)
+					{
+						const double value = reader.Read(property.type);
+						if (attributes[p] >= 0)
+							values[attributes[p]] = value;
+						continue;
+					}
+
+					const size_t count = static_cast<size_t>(reader.Read(property.count_type));
+					const bool is_face = element.name == "face" && (property.name == "vertex_indices" || property.name == "vertex_index");
+
+					polygon.clear();
+					for (size_t k = 0; k < count; k++)
+					{
+						const double value = reader.Read(property.type);
+						if (is_face)
+							polygon.push_back(static_cast<uint32_t>(value));
+					}
+
+					for (size_t k = 2; k < polygon.size(); k++)
+						data.indices.insert(data.indices.end(), { polygon[0], polygon[k - 1], polygon[k] });
+				}
+
+				if (element.name == "vertex")
+				{
+					data.positions.emplace_back(values[0], values[1], values[2]);
+					if (has_normals)
+						data.normals.push_back(Vector3::Normalized(Vector3(values[3], values[4], values[5])));
+					if (has_uvs)
+						data.uvs.insert(data.uvs.end(), { values[6], values[7] });
+				}
+			}
+		}
+
+		return data;
+	}
+
+	static TypePLY ParseTypePLY(const std::string& name)
+	{
+		if (name == "char" || name == "int8")     return TypePLY::Int8;
+		if (name == "uchar" || name == "uint8")   return TypePLY::UInt8;
+		if (name == "short" || name == "int16")   return TypePLY::Int16;
+		if (name == "ushort" || name == "uint16") return TypePLY::UInt16;
+		if (name == "int" || name == "int32")     return TypePLY::Int32;
+		if (name == "uint" || name == "uint32")   return TypePLY::UInt32;
+		if (name == "float" || name == "float32") return TypePLY::Float32;
+		if (name == "double" || name == "float64") return TypePLY::Float64;
+		throw std::exception(("Unsupported PLY property type: " + name).c_str());
+	}
+};
@@ -57,16 +57,22 @@ public:
                 return false;
         }
 
-        // Fill the HitRecord structure with all the info about the intersection.
         hit.t = root;
+        hit.object = this;
+        return true;
+    }
+
+
+    // Fill the HitRecord structure with all the info about the intersection.
+    virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+        const noexcept override final
+    {
         hit.point = ray.At(hit.t);
         const Vector3 outward_normal = (hit.point - GetCenterAt(ray.time)) / radius;
         GetSphereUV(outward_normal, hit.u, hit.v);
         hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
         hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
         hit.material = material.get();
-
-        return true;
     }
 
 
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+
+#include "Common.h"
+#include "AABB.h"
+
+
+// Relative costs used to evaluate the Surface Area Heuristic.
+constexpr double TraversalCostSAH = 1.0;		// Ray-node test
+constexpr double IntersectionCostSAH = 2.0;		// Ray-primitive test (a virtual call)
+
+// Maximum depth of a BVH, which bounds the size of the traversal stacks.
+constexpr int MaxDepthBVH = 64;
+
+// Maximum number of primitives in a leaf, whose count is stored in 16 bits.
+constexpr uint32_t MaxLeafCountBVH = 0xFFFF;
+
+// Maximum number of primitives in a sub-tree rooted at the given depth, with full leaves all at the maximum depth.
+// The builders split evenly any node with a child larger than this, so that the leaves forced by the depth limit
+// never overflow their count.
+constexpr uint64_t MaxSubtreeCountBVH(const int depth) noexcept
+{
+	const int levels = MaxDepthBVH - 1 - depth;
+	return levels >= 32 ? std::numeric_limits<uint64_t>::max() : uint64_t(MaxLeafCountBVH) << levels;
+}
+
+
+// Compact BVH node, laid out so that two nodes fit in a single cache line.
+// The bounds are stored in single precision, rounded outwards so that the
+// box always contains the double precision bounds of its primitives.
+struct alignas(32) NodeBVH
+{
+	float    min[3];
+	float    max[3];
+	uint32_t offset;		// Leaf: index of the first primitive, Interior: index of the second child
+	uint16_t count;			// Number of primitives in a leaf node (0 for interior nodes)
+	uint8_t  axis;			// Split axis of interior nodes
+	uint8_t  pad;
+
+	bool IsLeaf() const noexcept { return count > 0; }
+
+	void SetBounds(const AABB& box) noexcept
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			min[a] = RoundDown(box.min[a]);
+			max[a] = RoundUp(box.max[a]);
+		}
+	}
+
+	// Round a coordinate outwards to single precision, skipping the denormal values around 0
+	// (e.g. when a box touches a plane at 0), which are very slow to do any arithmetic with.
+	static float RoundDown(const double value) noexcept
+	{
+		const float result = std::nextafter(static_cast<float>(value), -std::numeric_limits<float>::infinity());
+		return std::abs(result) < std::numeric_limits<float>::min() ? -std::numeric_limits<float>::min() : result;
+	}
+
+	static float RoundUp(const double value) noexcept
+	{
+		const float result = std::nextafter(static_cast<float>(value), std::numeric_limits<float>::infinity());
+		return std::abs(result) < std::numeric_limits<float>::min() ? std::numeric_limits<float>::min() : result;
+	}
+
+	// Ray-node slab test, using the precomputed inverse of the ray direction.
+	inline bool Hit(const float origin[3], const float inv_direction[3], float t_min, float t_max) const noexcept
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			float t0 = (min[a] - origin[a]) * inv_direction[a];
+			float t1 = (max[a] - origin[a]) * inv_direction[a];
+			if (inv_direction[a] < 0.0f)
+				std::swap(t0, t1);
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+			if (t_max < t_min)
+				return false;
+		}
+		return true;
+	}
+};
+
+static_assert(sizeof(NodeBVH) == 32, "NodeBVH is expected to be 32 bytes");
+
+
+// Motion of a BVH node during the shutter interval: the offsets between the bounds at shutter close
+// and the ones at shutter open (stored in the node itself). The box at any time in between is found
+// by linear interpolation, which always contains primitives moving linearly (or their bounds).
+struct NodeMotionBVH
+{
+	float min[3];
+	float max[3];
+};
+
+
+// Shutter interval over which the motion of the nodes is described.
+struct MotionIntervalBVH
+{
+	double start = 0.0;
+	double scale = 0.0;		// Inverse of the interval length
+
+	// Returns the interpolation weight between the bounds at shutter open (0) and close (1) for the given time.
+	float GetWeight(const double time) const noexcept
+	{
+		return static_cast<float>(std::clamp((time - start) * scale, 0.0, 1.0));
+	}
+};
+
+
+enum class BuilderBVH
+{
+	SAH,		// Top-down binned SAH, slower to build but higher quality
+	LBVH		// Linear BVH from Morton codes, fast to build for previews and animations
+};
+
+
+// Parameters controlling the construction of a BVH.
+struct BuildOptionsBVH
+{
+	uint32_t max_leaf_size = 4;		// Maximum number of primitives stored in a leaf
+	uint32_t width = 0;				// Children per node used for traversal (2, 4 or 8), 0 picks the widest one supported by the CPU
+	BuilderBVH builder = BuilderBVH::SAH;
+	uint32_t treelet_passes = 0;		// Treelet restructuring passes applied by the LBVH builder
+	uint32_t thread_count = 1;			// Number of threads used to build the hierarchy
+	uint32_t parallel_threshold = 4096;	// Sub-trees with fewer primitives than this are always built serially
+	double   rebuild_threshold = 1.5;	// Refitting rebuilds the hierarchy when its SAH cost grows past this factor
+	std::string cache_path;				// Cache file for the hierarchies built within objects (empty = not cached)
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Common.h"
+
+
+// Orthonormal basis, used to express in world space the directions sampled around the Z axis.
+class ONB
+{
+public:
+
+	Vector3 u;
+	Vector3 v;
+	Vector3 w;
+
+public:
+
+	// Build a basis around the given unit vector (w), without any normalization or branch on its axes
+	// (Duff et al., "Building an Orthonormal Basis, Revisited").
+	explicit ONB(const Vector3& normal) noexcept
+		: w(normal)
+	{
+		const double sign = std::copysign(1.0, normal.z());
+		const double a = -1.0 / (sign + normal.z());
+		const double b = normal.x() * normal.y() * a;
+		u = Vector3(1.0 + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x());
+		v = Vector3(b, sign + normal.y() * normal.y() * a, -normal.y());
+	}
+
+	// Transform a vector from the local coordinates of the basis to world space.
+	Vector3 Local(const Vector3& a) const noexcept
+	{
+		return a.x() * u + a.y() * v + a.z() * w;
+	}
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <thread>
+#include <algorithm>
+#include <functional>
+
+#include "Common.h"
+
+
+/* Split the range [begin, end) into contiguous chunks, one for each thread, and run the
+    given function on all of them in parallel (the calling thread processes the last chunk).
+    @param function  Callable as void(size_t chunk_begin, size_t chunk_end, uint32_t chunk_index).
+*/
+template <typename Function>
+void ParallelFor(const size_t begin, const size_t end, uint32_t thread_count, Function&& function)
+{
+    const size_t count = end > begin ? end - begin : 0;
+    thread_count = static_cast<uint32_t>(std::clamp<size_t>(thread_count, 1, std::max<size_t>(count, 1)));
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+
+    for (uint32_t t = 0; t < thread_count; t++)
+    {
+        const size_t chunk_begin = begin + t * count / thread_count;
+        const size_t chunk_end = begin + (t + 1) * count / thread_count;
+
+        if (t + 1 < thread_count)
+            threads.emplace_back(std::ref(function), chunk_begin, chunk_end, t);
+        else
+            function(chunk_begin, chunk_end, t);
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Common.h"
+#include "Hittable.h"
+#include "WideBVH.h"
+#include "BVHCache.h"
+#include "Parallel.h"
+
+
+// Group of objects with its own BVH, which the scene can reference many times through instances: the objects
+// and the hierarchy over them are stored only once, and each instance enters it with the ray in its own space.
+// Hits record the object of the group that was hit, which then fills in the surface attributes.
+class Prototype : public Hittable
+{
+private:
+
+	std::vector<std::shared_ptr<Hittable>> m_objects;
+	std::vector<uint32_t> m_lights;			// Indices of the emissive objects
+	TraversalBVH m_bvh;
+
+public:
+
+	// The hierarchy is built over the bounds of the objects during the whole interval [t_start, t_end],
+	// which must cover all the times of the rays that will be traced against them.
+	Prototype(std::vector<std::shared_ptr<Hittable>> objects, const double t_start, const double t_end, const BuildOptionsBVH& options = {})
+		: m_objects(std::move(objects))
+	{
+		std::vector<AABB> bounds(m_objects.size());
+		ParallelFor(0, m_objects.size(), options.thread_count, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (!m_objects[i]->BoundingBox(t_start, t_end, bounds[i]))
+					std::cerr << "No bounding box for prototype object " << i << ".\n";
+			}
+		});
+
+		for (uint32_t i = 0; i < m_objects.size(); i++)
+		{
+			if (m_objects[i]->IsEmissive())
+				m_lights.push_back(i);
+		}
+
+		BVHCache::BuildObject(m_bvh.GetBVH(), bounds, options);
+		m_bvh.Collapse(options.width);
+	}
+
+
+	// Ray-objects intersection checking, through the hierarchy of the prototype.
+	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
+		const noexcept override final
+	{
+		const auto intersect = [&](const uint32_t index, const double t_lower, double& t_closest)
+		{
+			if (!m_objects[index]->Hit(ray, t_lower, t_closest, hit))
+				return false;
+
+			t_closest = hit.t;
+			hit.prototype_object = hit.object;
+			hit.object = this;
+			return true;
+		};
+
+		return m_bvh.Hit(ray, t_min, t_max, intersect);
+	}
+
+
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
+		hit.prototype_object->SurfaceAttributes(ray, hit);
+	}
+
+
+	// The bounds of the objects at the given times, which can be tighter than those of the hierarchy.
+	virtual bool BoundingBox(const double t_start, const double t_end, AABB& box)
+		const noexcept override final
+	{
+		box = AABB::Empty();
+		bool has_box = false;
+
+		for (const auto& object : m_objects)
+		{
+			AABB object_box;
+			if (object->BoundingBox(t_start, t_end, object_box))
+			{
+				box = AABB::Combine(box, object_box);
+				has_box = true;
+			}
+		}
+
+		return has_box;
+	}
+
+
+	virtual bool IsEmissive() const noexcept override final
+	{
+		return !m_lights.empty();
+	}
+
+
+	// An emissive object is picked uniformly, so the density is the average of those of all of them.
+	virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
+		const noexcept override final
+	{
+		double pdf = 0.0;
+		for (const uint32_t light : m_lights)
+			pdf += m_objects[light]->DirectionPdf(origin, direction, time);
+
+		return pdf / m_lights.size();
+	}
+
+
+	virtual Vector3 SampleDirection(const Point3& origin, const double time)
+		const noexcept override final
+	{
+		const size_t index = std::min(static_cast<size_t>(Random::GetInteger(0, static_cast<int>(m_lights.size()) - 1)), m_lights.size() - 1);
+		return m_objects[m_lights[index]]->SampleDirection(origin, time);
+	}
+};
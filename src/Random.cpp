@@ -1,9 +1,19 @@
 #include "Random.h"
 #include "Common.h"
+#include "Sampler.h"
 
 
 // Initialize the random number generator
-thread_local std::mt19937_64 Random::m_generator = std::mt19937_64();
+thread_local Random::Engine Random::m_generator = Random::Engine();
+thread_local Sampler* Random::m_sampler = nullptr;
+
+
+// Convert the 53 most significant bits of a random number to a double in [0, 1),
+// which is uniformly distributed and much cheaper than std::uniform_real_distribution.
+static inline double ToUnitDouble(const uint64_t bits) noexcept
+{
+	return static_cast<double>(bits >> 11) * 0x1.0p-53;
+}
 
 
 void Random::SeedCurrentThread(const unsigned long long seed) noexcept
@@ -11,17 +21,38 @@ void Random::SeedCurrentThread(const unsigned long long seed) noexcept
 	m_generator.seed(seed);
 }
 
+void Random::SeedSample(const uint32_t pixel, const uint32_t sample) noexcept
+{
+	// Start a separate stream for each sample of each pixel, from which all its dimensions (pixel jitter,
+	// lens, bounces...) are drawn in order. Xoshiro256 hashes the seed (with SplitMix64) into its state,
+	// so neighboring pixels and samples still get uncorrelated streams.
+	m_generator.seed((static_cast<uint64_t>(pixel) << 32) | sample);
+}
+
+
+void Random::SetSampler(Sampler* sampler) noexcept
+{
+	m_sampler = sampler;
+}
+
+double Random::GetUniform() noexcept
+{
+	double value;
+	if (m_sampler && m_sampler->Next(value))
+		return value;
+
+	return ToUnitDouble(m_generator());
+}
+
 
 int Random::GetInteger(const int min, const int max) noexcept
 {
-	std::uniform_real_distribution<double> distribution(min, max+1);
-	return static_cast<int>(distribution(m_generator));
+	return min + static_cast<int>(GetUniform() * (static_cast<double>(max) - min + 1));
 }
 
 double Random::GetDouble(const double min, const double max) noexcept
 {
-	std::uniform_real_distribution<double> distribution(min, max);
-	return distribution(m_generator);
+	return min + (max - min) * GetUniform();
 }
 
 Vector3 Random::GetVector(const double min, const double max) noexcept
@@ -39,19 +70,17 @@ Color Random::GetColor(const double min, const double max) noexcept
 
 Vector3 Random::GetUnitVector() noexcept
 {
-	return Vector3::Normalized(Random::GetVectorInUnitSphere());
+	// Uniform on the sphere: z is uniform in [-1, +1] (Archimedes' hat-box theorem), and so is the angle around it.
+	const double z = Random::GetDouble(-1.0, 1.0);
+	const double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+	const double phi = Random::GetDouble(0.0, 2.0 * PI);
+	return Vector3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 Vector3 Random::GetVectorInUnitSphere() noexcept
 {
-	while (true)
-	{
-		// Pick a random point in the unit cube, where x, y, and z in [-1, +1].
-		const Vector3 vec = Random::GetVector(-1, 1);
-		// Reject this point and try again if the point is outside the sphere.
-		if (vec.SqrLength() >= 1) continue;
-		return vec;
-	}
+	// The volume within a radius grows with its cube, so the radius is the cube root of a uniform value.
+	return std::cbrt(Random::GetDouble(0.0, 1.0)) * Random::GetUnitVector();
 }
 
 Vector3 Random::GetVectorInHemisphere(const Vector3& normal) noexcept
@@ -64,12 +93,19 @@ Vector3 Random::GetVectorInHemisphere(const Vector3& normal) noexcept
 
 Vector3 Random::GetVectorInUnitDisk() noexcept
 {
-	while (true)
-	{
-		const Vector3 vec = Vector3(Random::GetDouble(-1, 1), Random::GetDouble(-1, 1), 0);
-		if (vec.SqrLength() >= 1.0) continue;
-		return vec;
-	}
+	// The area within a radius grows with its square, so the radius is the square root of a uniform value.
+	const double r = std::sqrt(Random::GetDouble(0.0, 1.0));
+	const double phi = Random::GetDouble(0.0, 2.0 * PI);
+	return Vector3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+Vector3 Random::GetCosineDirection() noexcept
+{
+	// Project a point uniformly distributed on the unit disk up to the hemisphere (Malley's method),
+	// which gives directions distributed as cos(theta) / PI around the Z axis.
+	const Vector3 disk = Random::GetVectorInUnitDisk();
+	const double z = std::sqrt(std::max(0.0, 1.0 - disk.SqrLength()));
+	return Vector3(disk.x(), disk.y(), z);
 }
 
 
@@ -77,7 +113,15 @@ Perlin::Perlin()
 {
 	m_randomVectors = new Vector3[c_nPoints];
 	for (int i = 0; i < c_nPoints; ++i)
-		m_randomVectors[i] = Random::GetUnitVector();
+	{
+		// Normalize points picked in the unit sphere by rejection, which is slower than Random::GetUnitVector()
+		// but only done once, and keeps generating the same noise (and textures) from the same seed.
+		Vector3 vec = Random::GetVector(-1, 1);
+		while (vec.SqrLength() >= 1)
+			vec = Random::GetVector(-1, 1);
+
+		m_randomVectors[i] = Vector3::Normalized(vec);
+	}
 
 	m_permutationX = GeneratePermutation();
 	m_permutationY = GeneratePermutation();
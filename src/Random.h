@@ -1,19 +1,104 @@
 #pragma once
 
 #include <random>
+#include <cstdint>
 
 #include "Vector3.h"
 
+class Sampler;		// Forward declaration
+
+
+// Small and fast pseudo-random generator (xoshiro256++, by D. Blackman and S. Vigna), with only 256 bits
+// of state. It follows the interface of the standard engines, so that they can be swapped for it.
+class Xoshiro256
+{
+public:
+
+	using result_type = uint64_t;
+
+private:
+
+	uint64_t m_state[4];
+
+public:
+
+	explicit Xoshiro256(const uint64_t value = 0) noexcept
+	{
+		seed(value);
+	}
+
+	// Expand the seed to the whole state with SplitMix64, as recommended by the authors,
+	// which also makes sure that the state is never all zeros.
+	void seed(uint64_t value) noexcept
+	{
+		for (uint64_t& word : m_state)
+		{
+			value += 0x9e3779b97f4a7c15ull;
+			uint64_t z = value;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			word = z ^ (z >> 31);
+		}
+	}
+
+	static constexpr result_type min() noexcept { return 0; }
+	static constexpr result_type max() noexcept { return UINT64_MAX; }
+
+	result_type operator()() noexcept
+	{
+		const uint64_t result = RotateLeft(m_state[0] + m_state[3], 23) + m_state[0];
+		const uint64_t t = m_state[1] << 17;
+
+		m_state[2] ^= m_state[0];
+		m_state[3] ^= m_state[1];
+		m_state[1] ^= m_state[2];
+		m_state[0] ^= m_state[3];
+		m_state[2] ^= t;
+		m_state[3] = RotateLeft(m_state[3], 45);
+
+		return result;
+	}
+
+private:
+
+	static constexpr uint64_t RotateLeft(const uint64_t x, const int k) noexcept
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+};
+
+
+// How the random number streams are assigned to the render work.
+enum class RandomStreams
+{
+	Thread,		// One stream per thread, so the image depends on the number of threads and the scheduling
+	Pixel		// One stream per pixel sample, so the image is always the same for the same settings
+};
+
 
 class Random
 {
+public:
+
+	// Define RT_RANDOM_MT19937 to fall back to the original generator, with a much larger (2.5 KB) and slower state.
+#if defined(RT_RANDOM_MT19937)
+	using Engine = std::mt19937_64;
+#else
+	using Engine = Xoshiro256;
+#endif
+
 private:
 
-	static thread_local std::mt19937_64 m_generator;
+	static thread_local Engine m_generator;
+	static thread_local Sampler* m_sampler;
 
 public:
 
 	static void SeedCurrentThread(const unsigned long long seed) noexcept;
+	static void SeedSample(const uint32_t pixel, const uint32_t sample) noexcept;
+
+	// Draw the numbers from the given sampler, as long as it has dimensions left (nullptr to stop).
+	static void SetSampler(Sampler* sampler) noexcept;
 
 	static int     GetInteger(const int min, const int max) noexcept;
 	static double  GetDouble(const double min, const double max) noexcept;
@@ -24,6 +109,11 @@ public:
 	static Vector3 GetVectorInUnitSphere() noexcept;
 	static Vector3 GetVectorInHemisphere(const Vector3& normal) noexcept;
 	static Vector3 GetVectorInUnitDisk() noexcept;
+	static Vector3 GetCosineDirection() noexcept;
+
+private:
+
+	static double GetUniform() noexcept;
 };
 
 
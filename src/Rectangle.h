@@ -4,6 +4,7 @@
 
 #include "Common.h"
 #include "Hittable.h"
+#include "Material.h"
 
 
 class Rectangle : public Hittable
@@ -85,13 +86,7 @@ public:
 					return false;
 
 				hit.t = t;
-				hit.point = Point3(x, y, k);
-				hit.u = (x - a0) / (a1 - a0);
-				hit.v = (y - b0) / (b1 - b0);
-				const Vector3 outward_normal = Vector3(0.0, 0.0, 1.0);
-				hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
-				hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
-				hit.material = material.get();
+				hit.object = this;
 				return true;
 			}
 
@@ -110,13 +105,7 @@ public:
 					return false;
 
 				hit.t = t;
-				hit.point = Point3(x, k, z);
-				hit.u = (x - a0) / (a1 - a0);
-				hit.v = (z - b0) / (b1 - b0);
-				const Vector3 outward_normal = Vector3(0.0, 1.0, 0.0);
-				hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
-				hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
-				hit.material = material.get();
+				hit.object = this;
 				return true;
 			}
 
@@ -135,18 +124,62 @@ public:
 					return false;
 
 				hit.t = t;
+				hit.object = this;
+				return true;
+			}
+
+			default: return false;
+		}
+	}
+
+
+	// Fill the HitRecord structure with all the info about the intersection.
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
+		Vector3 outward_normal;
+
+		switch (type)
+		{
+			case Type::XY:
+			{
+				const double x = ray.origin.x() + hit.t * ray.direction.x();
+				const double y = ray.origin.y() + hit.t * ray.direction.y();
+				hit.point = Point3(x, y, k);
+				hit.u = (x - a0) / (a1 - a0);
+				hit.v = (y - b0) / (b1 - b0);
+				outward_normal = Vector3(0.0, 0.0, 1.0);
+				break;
+			}
+
+			case Type::XZ:
+			{
+				const double x = ray.origin.x() + hit.t * ray.direction.x();
+				const double z = ray.origin.z() + hit.t * ray.direction.z();
+				hit.point = Point3(x, k, z);
+				hit.u = (x - a0) / (a1 - a0);
+				hit.v = (z - b0) / (b1 - b0);
+				outward_normal = Vector3(0.0, 1.0, 0.0);
+				break;
+			}
+
+			case Type::YZ:
+			{
+				const double y = ray.origin.y() + hit.t * ray.direction.y();
+				const double z = ray.origin.z() + hit.t * ray.direction.z();
 				hit.point = Point3(k, y, z);
 				hit.u = (y - a0) / (a1 - a0);
 				hit.v = (z - b0) / (b1 - b0);
-				const Vector3 outward_normal = Vector3(1.0, 0.0, 0.0);
-				hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
-				hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
-				hit.material = material.get();
-				return true;
+				outward_normal = Vector3(1.0, 0.0, 0.0);
+				break;
 			}
 
-			default: return false;
+			default: return;
 		}
+
+		hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
+		hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
+		hit.material = material.get();
 	}
 
 
@@ -164,4 +197,60 @@ public:
 			default: return false;
 		}
 	}
+
+
+	virtual bool IsEmissive() const noexcept override final
+	{
+		return material->IsEmissive();
+	}
+
+
+	// Solid angle density of the directions towards points uniformly distributed on the rectangle,
+	// obtained by dividing the area density by the cosine at the point and its squared distance.
+	virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
+		const noexcept override final
+	{
+		HitRecord hit;
+		if (!Hit(Ray(origin, direction, time), 0.001, Infinity, hit))
+			return 0.0;
+
+		const double sqr_length = direction.SqrLength();
+		const double sqr_distance = hit.t * hit.t * sqr_length;
+		const double cosine = std::fabs(direction[Axis()]) / std::sqrt(sqr_length);
+		return sqr_distance / (cosine * (a1 - a0) * (b1 - b0));
+	}
+
+
+	virtual Vector3 SampleDirection(const Point3& origin, const double /*time*/)
+		const noexcept override final
+	{
+		const double a = Random::GetDouble(a0, a1);
+		const double b = Random::GetDouble(b0, b1);
+		return PlanePoint(a, b) - origin;
+	}
+
+
+	// Point on the plane of the rectangle, at the given coordinates along its two axes.
+	Point3 PlanePoint(const double a, const double b) const noexcept
+	{
+		switch (type)
+		{
+			case Type::XY: return Point3(a, b, k);
+			case Type::XZ: return Point3(a, k, b);
+			default:       return Point3(k, a, b);
+		}
+	}
+
+private:
+
+	// Axis along the rectangle normal.
+	int Axis() const noexcept
+	{
+		switch (type)
+		{
+			case Type::XY: return 2;
+			case Type::XZ: return 1;
+			default: return 0;
+		}
+	}
 };
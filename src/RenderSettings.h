@@ -2,8 +2,12 @@
 
 #include <iostream>
 #include <exception>
+#include <filesystem>
 
 #include "Common.h"
+#include "TileScheduler.h"
+#include "NodeBVH.h"
+#include "Sampler.h"
 
 
 class RenderSettings
@@ -15,8 +19,31 @@ private:
     uint32_t        m_imageWidth = 1280;
     uint32_t        m_imageHeight = 720;
     uint32_t        m_samplesPerPixel = 500;
+    uint32_t        m_minSamplesPerPixel = 16;      // Taken by every pixel before adaptive sampling can stop
+    double          m_noiseThreshold = 0.0;         // 0 = adaptive sampling disabled
+    std::string     m_heatmapPath;                  // Empty = no heatmap of the samples per pixel
+    uint32_t        m_targetSamples = 0;            // 0 = same as the samples per pixel
+    uint32_t        m_passSamples = 4;              // Samples per pixel added by each progressive pass
+    double          m_timeLimit = 0.0;              // In seconds, 0 = no limit
+    std::string     m_checkpointPath;               // Empty = no checkpoints
+    double          m_checkpointInterval = 60.0;    // In seconds
+    std::string     m_resumePath;                   // Empty = start from scratch
     uint32_t        m_maxBounces = 50;
+    uint32_t        m_rrDepth = 5;                  // Bounces after which paths may be terminated by Russian roulette
+    SamplerType     m_samplerType = SamplerType::Random;
     uint32_t        m_threadCount = 4;
+    RandomStreams   m_randomStreams = RandomStreams::Thread;
+    uint32_t        m_tileSize = 32;
+    TileOrder       m_tileOrder = TileOrder::Morton;
+    uint32_t        m_bvhLeafSize = 4;
+    uint32_t        m_bvhWidth = 0;                 // 0 = automatic, based on the CPU features
+    uint32_t        m_buildThreadCount = 0;         // 0 = same as the number of render threads
+    BuilderBVH      m_bvhBuilder = BuilderBVH::SAH;
+    uint32_t        m_bvhTreeletPasses = 0;
+    double          m_bvhRebuildThreshold = 1.5;
+    uint32_t        m_frameCount = 1;
+    std::string     m_bvhCacheDirectory;            // Empty = same directory as the scene file
+    bool            m_bvhCacheEnabled = true;
     double          m_aspectRatio = 16.0 / 9.0;
 
 public:
@@ -26,8 +53,41 @@ public:
     uint32_t      ImageWidth()       const noexcept { return m_imageWidth; }
     uint32_t      ImageHeight()      const noexcept { return m_imageHeight; }
     uint32_t      SamplesPerPixel()  const noexcept { return m_samplesPerPixel; }
+    uint32_t      MinSamplesPerPixel() const noexcept { return m_minSamplesPerPixel; }
+    double        NoiseThreshold()   const noexcept { return m_noiseThreshold; }
+    std::string   HeatmapPath()      const noexcept { return m_heatmapPath; }
+    uint32_t      SampleTarget()     const noexcept { return m_targetSamples ? m_targetSamples : m_samplesPerPixel; }
+    uint32_t      PassSamples()      const noexcept { return m_passSamples; }
+    double        TimeLimit()        const noexcept { return m_timeLimit; }
+    bool          IsProgressive()    const noexcept { return m_targetSamples > 0 || m_timeLimit > 0.0; }
+    std::string   CheckpointPath()   const noexcept { return m_checkpointPath.empty() ? m_resumePath : m_checkpointPath; }
+    double        CheckpointInterval() const noexcept { return m_checkpointInterval; }
+    std::string   ResumePath()       const noexcept { return m_resumePath; }
     uint32_t      MaxBounces()       const noexcept { return m_maxBounces; }
+    uint32_t      RussianRouletteDepth() const noexcept { return m_rrDepth; }
+    SamplerType   GetSamplerType()   const noexcept { return m_samplerType; }
     uint32_t      ThreadCount()      const noexcept { return m_threadCount; }
+    RandomStreams GetRandomStreams() const noexcept { return m_randomStreams; }
+    uint32_t      TileSize()         const noexcept { return m_tileSize; }
+    TileOrder     GetTileOrder()     const noexcept { return m_tileOrder; }
+    uint32_t      BVHLeafSize()      const noexcept { return m_bvhLeafSize; }
+    uint32_t      BVHWidth()         const noexcept { return m_bvhWidth; }
+    uint32_t      BuildThreadCount() const noexcept { return m_buildThreadCount ? m_buildThreadCount : m_threadCount; }
+    BuilderBVH    GetBVHBuilder()    const noexcept { return m_bvhBuilder; }
+    uint32_t      BVHTreeletPasses() const noexcept { return m_bvhTreeletPasses; }
+    double        BVHRebuildThreshold() const noexcept { return m_bvhRebuildThreshold; }
+    uint32_t      FrameCount()       const noexcept { return m_frameCount; }
+
+    // Returns the path of the BVH cache file for the scene, or an empty string if the cache is disabled.
+    std::string BVHCachePath() const
+    {
+        if (!m_bvhCacheEnabled)
+            return std::string();
+
+        const std::filesystem::path scene_path(m_scenePath);
+        const std::filesystem::path directory = m_bvhCacheDirectory.empty() ? scene_path.parent_path() : std::filesystem::path(m_bvhCacheDirectory);
+        return (directory / scene_path.filename()).string() + ".bvh";
+    }
     double        AspectRatio()      const noexcept { return m_aspectRatio; }
 
 
@@ -64,16 +124,133 @@ public:
                 m_samplesPerPixel = ReadUInt32Param(argv, index, "samples");
                 index += 1;
             }
+            else if (option.compare("--min-samples") == 0)
+            {
+                m_minSamplesPerPixel = ReadUInt32Param(argv, index, "min-samples");
+                index += 1;
+            }
+            else if (option.compare("--noise-threshold") == 0)
+            {
+                m_noiseThreshold = ReadDoubleParam(argv, index, "noise-threshold");
+                index += 1;
+            }
+            else if (option.compare("--heatmap") == 0)
+            {
+                m_heatmapPath = ReadStringParam(argv, index, "heatmap");
+                index += 1;
+            }
+            else if (option.compare("--target-spp") == 0)
+            {
+                m_targetSamples = ReadUInt32Param(argv, index, "target-spp");
+                index += 1;
+            }
+            else if (option.compare("--pass-samples") == 0)
+            {
+                m_passSamples = ReadUInt32Param(argv, index, "pass-samples");
+                index += 1;
+            }
+            else if (option.compare("--time-limit") == 0)
+            {
+                m_timeLimit = ReadDoubleParam(argv, index, "time-limit");
+                index += 1;
+            }
+            else if (option.compare("--checkpoint") == 0)
+            {
+                m_checkpointPath = ReadStringParam(argv, index, "checkpoint");
+                index += 1;
+            }
+            else if (option.compare("--checkpoint-interval") == 0)
+            {
+                m_checkpointInterval = ReadDoubleParam(argv, index, "checkpoint-interval");
+                index += 1;
+            }
+            else if (option.compare("--resume") == 0)
+            {
+                m_resumePath = ReadStringParam(argv, index, "resume");
+                index += 1;
+            }
             else if (option.compare("-b") == 0 || option.compare("--bounces") == 0)
             {
                 m_maxBounces = ReadUInt32Param(argv, index, "bounces");
                 index += 1;
             }
+            else if (option.compare("--rr-depth") == 0)
+            {
+                m_rrDepth = ReadUInt32Param(argv, index, "rr-depth");
+                index += 1;
+            }
+            else if (option.compare("--sampler") == 0)
+            {
+                m_samplerType = ReadSamplerParam(argv, index, "sampler");
+                index += 1;
+            }
             else if (option.compare("-t") == 0 || option.compare("--threads") == 0)
             {
                 m_threadCount = ReadUInt32Param(argv, index, "threads");
                 index += 1;
             }
+            else if (option.compare("--random-streams") == 0)
+            {
+                m_randomStreams = ReadRandomStreamsParam(argv, index, "random-streams");
+                index += 1;
+            }
+            else if (option.compare("--tile-size") == 0)
+            {
+                m_tileSize = ReadUInt32Param(argv, index, "tile-size");
+                index += 1;
+            }
+            else if (option.compare("--tile-order") == 0)
+            {
+                m_tileOrder = ReadTileOrderParam(argv, index, "tile-order");
+                index += 1;
+            }
+            else if (option.compare("--bvh-leaf-size") == 0)
+            {
+                m_bvhLeafSize = ReadUInt32Param(argv, index, "bvh-leaf-size");
+                index += 1;
+            }
+            else if (option.compare("--bvh-width") == 0)
+            {
+                m_bvhWidth = ReadUInt32Param(argv, index, "bvh-width");
+                if (m_bvhWidth != 2 && m_bvhWidth != 4 && m_bvhWidth != 8)
+                    throw std::exception("'bvh-width' must be either 2, 4 or 8");
+                index += 1;
+            }
+            else if (option.compare("--build-threads") == 0)
+            {
+                m_buildThreadCount = ReadUInt32Param(argv, index, "build-threads");
+                index += 1;
+            }
+            else if (option.compare("--bvh-builder") == 0)
+            {
+                m_bvhBuilder = ReadBuilderParam(argv, index, "bvh-builder");
+                index += 1;
+            }
+            else if (option.compare("--bvh-treelet-passes") == 0)
+            {
+                m_bvhTreeletPasses = ReadUInt32Param(argv, index, "bvh-treelet-passes");
+                index += 1;
+            }
+            else if (option.compare("--bvh-rebuild-threshold") == 0)
+            {
+                m_bvhRebuildThreshold = ReadDoubleParam(argv, index, "bvh-rebuild-threshold");
+                if (m_bvhRebuildThreshold < 1.0)
+                    throw std::exception("'bvh-rebuild-threshold' must be at least 1.0");
+                index += 1;
+            }
+            else if (option.compare("--bvh-cache") == 0)
+            {
+                m_bvhCacheDirectory = ReadStringParam(argv, index, "bvh-cache");
+                m_bvhCacheEnabled = m_bvhCacheDirectory != "off";
+                if (!m_bvhCacheEnabled)
+                    m_bvhCacheDirectory.clear();
+                index += 1;
+            }
+            else if (option.compare("--frames") == 0)
+            {
+                m_frameCount = ReadUInt32Param(argv, index, "frames");
+                index += 1;
+            }
             else
             {
                 std::cerr << "WARNING: "
@@ -90,9 +267,27 @@ public:
             << " Scene File: \t\t"          << m_scenePath                              << '\n'
             << " Output File: \t\t"         << m_outputPath                             << '\n'
             << " Image Resolution: \t"      << m_imageWidth << 'x' << m_imageHeight     << '\n'
-            << " Samples per Pixel: \t"     << m_samplesPerPixel                        << '\n'
+            << " Samples per Pixel: \t"     << SampleTarget()                           << '\n'
+            << " Progressive: \t\t"         << (IsProgressive() ? std::to_string(m_passSamples) + " samples per pass" +
+                (m_timeLimit > 0.0 ? ", " + std::to_string(m_timeLimit) + "s time limit" : "") : "off") << '\n'
+            << " Checkpoints: \t\t"        << (CheckpointPath().empty() ? "off" : CheckpointPath() + " (every " + std::to_string(m_checkpointInterval) + "s)") << '\n'
+            << " Resume From: \t\t"        << (m_resumePath.empty() ? "-" : m_resumePath) << '\n'
+            << " Noise Threshold: \t"       << (m_noiseThreshold > 0.0 ? std::to_string(m_noiseThreshold) + " (min. " + std::to_string(m_minSamplesPerPixel) + " samples)" : "off") << '\n'
             << " Max. Bounces: \t\t"        << m_maxBounces                             << '\n'
+            << " Russian Roulette Depth: "   << m_rrDepth                                << '\n'
+            << " Sampler: \t\t"             << SamplerName(m_samplerType)               << '\n'
             << " Num. Threads: \t\t"        << m_threadCount                            << '\n'
+            << " Random Streams: \t"        << (m_randomStreams == RandomStreams::Pixel ? "pixel" : "thread") << '\n'
+            << " Tile Size: \t\t"           << m_tileSize << 'x' << m_tileSize          << '\n'
+            << " Tile Order: \t\t"          << TileOrderName(m_tileOrder)               << '\n'
+            << " BVH Leaf Size: \t"         << m_bvhLeafSize                            << '\n'
+            << " BVH Width: \t\t"           << (m_bvhWidth ? std::to_string(m_bvhWidth) : "auto") << '\n'
+            << " BVH Build Threads: \t"     << BuildThreadCount()                       << '\n'
+            << " BVH Builder: \t\t"         << (m_bvhBuilder == BuilderBVH::LBVH ? "lbvh" : "sah")
+            << (m_bvhTreeletPasses ? " (" + std::to_string(m_bvhTreeletPasses) + " treelet passes)" : "") << '\n'
+            << " BVH Rebuild Threshold: "    << m_bvhRebuildThreshold                    << '\n'
+            << " Frames: \t\t"              << m_frameCount                             << '\n'
+            << " BVH Cache: \t\t"           << (m_bvhCacheEnabled ? BVHCachePath() : "off") << '\n'
             << std::endl;
     }
 
@@ -119,13 +314,101 @@ private:
             
             return uint32_t(value_int);
         }
-        catch (std::exception e)
+        catch (const std::exception&)
+        {
+            std::string error = "\'" + value_str + "' is not a valid value for '" + name + '\'';
+            throw std::exception(error.c_str());
+        }
+    }
+
+    inline static double ReadDoubleParam(const char** const argv, const int index, const std::string& name)
+    {
+        std::string value_str = std::string(argv[index]);
+        try
+        {
+            double value = std::stod(value_str);
+            if (!(value > 0.0))
+                throw std::exception();
+
+            return value;
+        }
+        catch (const std::exception&)
         {
             std::string error = "\'" + value_str + "' is not a valid value for '" + name + '\'';
             throw std::exception(error.c_str());
         }
     }
 
+    inline static TileOrder ReadTileOrderParam(const char** const argv, const int index, const std::string& name)
+    {
+        const std::string value_str = std::string(argv[index]);
+
+        if (value_str == "scanline") return TileOrder::Scanline;
+        if (value_str == "morton")   return TileOrder::Morton;
+        if (value_str == "spiral")   return TileOrder::Spiral;
+
+        std::string error = "\'" + value_str + "' is not a valid value for '" + name + "' (scanline, morton, spiral)";
+        throw std::exception(error.c_str());
+    }
+
+    inline static SamplerType ReadSamplerParam(const char** const argv, const int index, const std::string& name)
+    {
+        const std::string value_str = std::string(argv[index]);
+
+        if (value_str == "random")     return SamplerType::Random;
+        if (value_str == "stratified") return SamplerType::Stratified;
+        if (value_str == "sobol")      return SamplerType::Sobol;
+        if (value_str == "bluenoise")  return SamplerType::BlueNoise;
+
+        std::string error = "\'" + value_str + "' is not a valid value for '" + name + "' (random, stratified, sobol, bluenoise)";
+        throw std::exception(error.c_str());
+    }
+
+    inline static RandomStreams ReadRandomStreamsParam(const char** const argv, const int index, const std::string& name)
+    {
+        const std::string value_str = std::string(argv[index]);
+
+        if (value_str == "thread") return RandomStreams::Thread;
+        if (value_str == "pixel")  return RandomStreams::Pixel;
+
+        std::string error = "\'" + value_str + "' is not a valid value for '" + name + "' (thread, pixel)";
+        throw std::exception(error.c_str());
+    }
+
+    inline static BuilderBVH ReadBuilderParam(const char** const argv, const int index, const std::string& name)
+    {
+        const std::string value_str = std::string(argv[index]);
+
+        if (value_str == "sah")  return BuilderBVH::SAH;
+        if (value_str == "lbvh") return BuilderBVH::LBVH;
+
+        std::string error = "\'" + value_str + "' is not a valid value for '" + name + "' (sah, lbvh)";
+        throw std::exception(error.c_str());
+    }
+
+    inline static const char* TileOrderName(const TileOrder order) noexcept
+    {
+        switch (order)
+        {
+            case TileOrder::Scanline: return "scanline";
+            case TileOrder::Morton:   return "morton";
+            case TileOrder::Spiral:   return "spiral";
+            default:                  return "unknown";
+        }
+    }
+
+    inline static const char* SamplerName(const SamplerType type) noexcept
+    {
+        switch (type)
+        {
+            case SamplerType::Random:     return "random";
+            case SamplerType::Stratified: return "stratified";
+            case SamplerType::Sobol:      return "sobol";
+            case SamplerType::BlueNoise:  return "bluenoise";
+            default:                      return "unknown";
+        }
+    }
+
     inline static std::string ReadOptionSpecifier(const char** const argv, const int index)
     {
         std::string option = std::string(argv[index]);
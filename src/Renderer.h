@@ -1,41 +1,65 @@
 #pragma once
 
 #include <thread>
+#include <chrono>
+#include <algorithm>
 
 #include "Common.h"
 #include "Scene.h"
-#include "Image.h"
+#include "Framebuffer.h"
 #include "RenderSettings.h"
+#include "TileScheduler.h"
+#include "Sampler.h"
+#include "Checkpoint.h"
 
 
 class RenderThread
 {
 private:
 
-    std::thread    m_thread;
+    using Clock = std::chrono::steady_clock;
+
     const uint32_t m_threadID;
     const Scene&   ref_scene;
-    Image&         ref_image;
-    const uint32_t m_samples;
+    Framebuffer&   ref_framebuffer;
+    const uint32_t m_pass;
+    const uint32_t m_samples;               // Maximum number of samples per pixel
+    const uint32_t m_passSamples;           // Samples added to each active pixel in this pass
+    const Clock::time_point m_deadline;     // Pixels are skipped once it is passed
     const uint32_t m_bounces;
+    const uint32_t m_rrDepth;
+    const RandomStreams m_randomStreams;
+    const uint64_t m_seed;                  // Unique per pass and thread, whatever the number of threads (which can change on resume)
+    std::unique_ptr<Sampler> m_sampler;     // nullptr when using independent random numbers
+
+    TileScheduler& ref_scheduler;
 
-    std::atomic_uint32_t& ref_counter;
+    std::thread    m_thread;        // Must be the last member, so that it starts after everything else is initialized
 
 public:
 
     RenderThread(const uint32_t thread_id,
         const Scene& scene,
-        Image& image,
-        const uint32_t samples,
-        const uint32_t bounces,
-        std::atomic_uint32_t& counter) :
+        Framebuffer& framebuffer,
+        const RenderSettings& settings,
+        const uint32_t pass,
+        const uint32_t pass_samples,
+        const Clock::time_point deadline,
+        TileScheduler& scheduler) :
         m_threadID(thread_id),
-        m_thread(std::thread(&RenderThread::RenderLoop, this)),
         ref_scene(scene),
-        ref_image(image),
-        m_samples(samples),
-        m_bounces(bounces),
-        ref_counter(counter)
+        ref_framebuffer(framebuffer),
+        m_pass(pass),
+        m_samples(settings.SampleTarget()),
+        m_passSamples(pass_samples),
+        m_deadline(deadline),
+        m_bounces(settings.MaxBounces()),
+        m_rrDepth(settings.RussianRouletteDepth()),
+        m_randomStreams(settings.GetRandomStreams()),
+        m_seed((uint64_t(pass) << 32) | thread_id),
+        m_sampler(Sampler::Create(settings.GetSamplerType(), settings.SampleTarget())),
+        ref_scheduler(scheduler),
+        m_thread(std::thread(&RenderThread::RenderLoop, this))
     {
     }
 
@@ -49,69 +73,193 @@ private:
 
     void RenderLoop() noexcept
     {
-        // Initialize the random number generator for this thread with a unique seed.
-        Random::SeedCurrentThread(m_threadID);
+        // Initialize the random number generator for this thread with a seed unique to the thread and the pass
+        // (only used if the streams are not started over for every pixel sample).
+        Random::SeedCurrentThread(m_seed);
+        Random::SetSampler(m_sampler.get());
+
+        Tile tile;
 
-        while (true)
+        // Keep grabbing tiles from the scheduler (stealing them from other threads
+        // when our own queue runs dry) until the whole image has been rendered.
+        while (ref_scheduler.Next(m_threadID, tile))
         {
-            // Grab the next scanline index from the atomic counter, and increment it.
-            const uint32_t j = ref_counter.fetch_add(1);
+            const auto start_time = Clock::now();
 
-            // Notify the main thread that a new scanline is being rendered.
-            ref_counter.notify_all();
+            RenderTile(tile);
 
-            // Stop the render loop when reached beyond the last scanline.
-            if (j >= ref_image.GetHeight())
-                break;
+            const auto end_time = Clock::now();
+            ref_scheduler.Complete(m_threadID, tile, std::chrono::duration<double>(end_time - start_time).count());
+        }
+    }
 
-            // Render each pixel in the scanline.
-            for (uint32_t i = 0; i < ref_image.GetWidth(); i++)
+
+    void RenderTile(const Tile& tile) noexcept
+    {
+        const bool has_deadline = m_deadline != Clock::time_point::max();
+
+        for (uint32_t j = tile.y0; j < tile.y1; j++)
+        {
+            for (uint32_t i = tile.x0; i < tile.x1; i++)
             {
-                Color pixel = Color(0, 0, 0);
+                // Once the time is up, the remaining tiles are still fetched from the scheduler, but left as they are.
+                if (has_deadline && Clock::now() >= m_deadline)
+                    return;
 
-                // Gather multiple samples per pixel, and accumulate them.
-                for (uint32_t s = 0; s < m_samples; s++)
+                Framebuffer::Pixel& pixel = ref_framebuffer.At(i, j);
+                if (pixel.active && pixel.next_pass <= m_pass)
                 {
-                    const double u = (i + Random::GetDouble(0.0, 1.0)) / ((double)ref_image.GetWidth() - 1);
-                    const double v = 1.0 - (j + Random::GetDouble(0.0, 1.0)) / ((double)ref_image.GetHeight() - 1);  // flip image vertically
-
-                    pixel += RayColor(ref_scene.camera.GetRay(u, v), ref_scene, m_bounces);
+                    TakeSamples(i, j, std::min(pixel.count + m_passSamples, m_samples), pixel);
+                    pixel.next_pass = m_pass + 1;
                 }
+            }
+        }
+    }
+
+
+    // Gather samples for a pixel, and accumulate them, until it has the given number.
+    void TakeSamples(const uint32_t i, const uint32_t j, const uint32_t count, Framebuffer::Pixel& pixel) noexcept
+    {
+        for (uint32_t s = pixel.count; s < count; s++)
+        {
+            if (m_randomStreams == RandomStreams::Pixel)
+                Random::SeedSample(j * ref_framebuffer.GetWidth() + i, s);
 
-                // Average the collected samples to get the color for the output pixel.
-                pixel /= m_samples;
-                ref_image.SetPixel(i, j, pixel);
+            // The camera dimensions are drawn in order: pixel position, lens position and time.
+            if (m_sampler)
+            {
+                m_sampler->StartSample(i, j, s);
+                m_sampler->Seek(Sampler::c_cameraDimension, Sampler::c_cameraDimensions);
             }
+
+            const double u = (i + Random::GetDouble(0.0, 1.0)) / ((double)ref_framebuffer.GetWidth() - 1);
+            const double v = 1.0 - (j + Random::GetDouble(0.0, 1.0)) / ((double)ref_framebuffer.GetHeight() - 1);  // flip image vertically
+
+            Framebuffer::AddSample(pixel, RayColor(ref_scene.camera.GetRay(u, v), ref_scene));
         }
     }
 
 
-    inline Color RayColor(const Ray& ray, const Scene& scene, const uint32_t bounces) const noexcept
+    inline Color RayColor(const Ray& camera_ray, const Scene& scene) const noexcept
     {
-        // If we've reached the ray bounce limit, no more light is gathered.
-        if (bounces == 0)
-            return Color(0.0, 0.0, 0.0);
+        Color  radiance = Color(0.0, 0.0, 0.0);
+        Color  throughput = Color(1.0, 1.0, 1.0);    // Fraction of the light at the current vertex that reaches the camera
+        Ray    ray = camera_ray;
+        double scattering_pdf = 0.0;                 // Density of the material sampling the current ray, zero if specular
 
-        HitRecord hit;
+        // Follow the path one bounce at a time, until the ray bounce limit is reached.
+        for (uint32_t depth = 0; depth < m_bounces; depth++)
+        {
+            HitRecord hit;
 
-        // Intersect the ray against the world geometry,
-        //  if it hits nothing return the background color.
-        if (!scene.Hit(ray, 0.001, Infinity, hit))
-            return scene.background;
+            SeekSampler(depth, Sampler::Medium, 1);
 
-        Ray   scattered;
-        Color attenuation;
-        Color emitted = hit.material->Emitted(ray, hit);
+            // Intersect the ray against the world geometry,
+            //  if it hits nothing gather the background color.
+            if (!scene.Hit(ray, 0.001, Infinity, hit))
+            {
+                radiance += throughput * scene.background;
+                break;
+            }
+
+            // Lights hit after a diffuse bounce could also have been reached by the light sampling at the
+            // previous vertex, so the two estimates are combined using multiple importance sampling.
+            const Color emitted = hit.material->Emitted(ray, hit);
+            if (!emitted.NearZero())
+            {
+                double weight = 1.0;
+                if (scattering_pdf > 0.0)
+                    weight = PowerHeuristic(scattering_pdf, scene.LightPdf(hit.object, ray.origin, ray.direction, ray.time));
+
+                radiance += throughput * emitted * weight;
+            }
 
-        // Scatter the ray against the surface (based on material properties).
-        if (!hit.material->Scatter(ray, hit, attenuation, scattered))
-            return emitted;
+            // Scatter the ray against the surface (based on material properties).
+            Ray   scattered;
+            Color attenuation;
+            SeekSampler(depth, Sampler::Scatter, 3);
+            if (!hit.material->Scatter(ray, hit, attenuation, scattered))
+                break;
+
+            // Terminate the path if the energy of the ray drops to almost zero.
+            if (attenuation.NearZero())
+                break;
 
-        // Terminate recursion if the energy of the ray drops to almost zero.
-        if (attenuation.NearZero())
-            return emitted;
+            scattering_pdf = hit.material->ScatteringPdf(ray, hit, scattered.direction);
+
+            // Next event estimation: add the light arriving directly from a randomly picked light, unless the
+            // material is specular, as the chance of a direction towards the light being reflected is zero.
+            if (scattering_pdf > 0.0 && !scene.lights.empty())
+            {
+                SeekSampler(depth, Sampler::LightChoice, 4);
+                radiance += throughput * SampleDirectLight(ray, hit, scene);
+            }
 
-        return emitted + attenuation * RayColor(scattered, scene, bounces - 1);
+            throughput = throughput * attenuation;
+
+            // Past the minimum depth, randomly terminate the paths that carry little energy (Russian roulette),
+            // boosting the ones that survive by the inverse of their survival probability to keep the estimate unbiased.
+            if (depth + 1 >= m_rrDepth)
+            {
+                SeekSampler(depth, Sampler::Roulette, 1);
+                const double survival = std::min(std::max({ throughput.x(), throughput.y(), throughput.z() }), 0.95);
+                if (Random::GetDouble(0.0, 1.0) >= survival)
+                    break;
+
+                throughput /= survival;
+            }
+
+            ray = scattered;
+        }
+
+        return radiance;
+    }
+
+
+    // Assign the next random numbers to the given dimensions of the current bounce, when using a sampler.
+    inline void SeekSampler(const uint32_t depth, const Sampler::BounceDimension first, const uint32_t count) const noexcept
+    {
+        if (m_sampler)
+            m_sampler->SeekBounce(depth, first, count);
+    }
+
+
+    // Trace a shadow ray towards a point sampled on one of the lights, returning the light it carries
+    // times the BSDF and cosine, divided by the light sampling density and weighted against the material one.
+    inline Color SampleDirectLight(const Ray& ray, const HitRecord& hit, const Scene& scene) const noexcept
+    {
+        Vector3 direction;
+        const Hittable* light = scene.SampleLight(hit.point, ray.time, direction);
+
+        // Lights can return the whole vector to the point sampled on them: with a unit direction instead,
+        // the shadow ray starts at the same small distance from the surface whatever the light.
+        direction = Vector3::Normalized(direction);
+
+        const double light_pdf = scene.LightPdf(light, hit.point, direction, ray.time);
+        if (light_pdf <= 0.0)
+            return Color(0.0, 0.0, 0.0);
+
+        const double scattering_pdf = hit.material->ScatteringPdf(ray, hit, direction);
+        if (scattering_pdf <= 0.0)
+            return Color(0.0, 0.0, 0.0);
+
+        // The light is visible only if it is the first object hit by the shadow ray.
+        const Ray shadow_ray(hit.point, direction, ray.time);
+        HitRecord light_hit;
+        if (!scene.Hit(shadow_ray, 0.001, Infinity, light_hit) || light_hit.object != light)
+            return Color(0.0, 0.0, 0.0);
+
+        const double weight = PowerHeuristic(light_pdf, scattering_pdf);
+        return hit.material->Evaluate(ray, hit, direction) * light_hit.material->Emitted(shadow_ray, light_hit) * (weight / light_pdf);
+    }
+
+
+    // Weight of a sample drawn with density pdf_a, against another strategy with density pdf_b.
+    static double PowerHeuristic(const double pdf_a, const double pdf_b) noexcept
+    {
+        const double a = pdf_a * pdf_a;
+        const double b = pdf_b * pdf_b;
+        return a / (a + b);
     }
 };
 
@@ -120,35 +268,111 @@ class Renderer
 {
 public:
 
-	static void Render(const Scene& scene, Image& image, const RenderSettings& settings) noexcept
+    // Render the image in passes, each one adding samples to the pixels of the framebuffer that still need them
+    // (all of them, unless adaptive sampling is enabled), until they are done or the time limit is reached.
+    // A framebuffer loaded from a checkpoint continues from its last pass, and new checkpoints are submitted
+    // to the writer (if any) at the given interval, and once more at the end.
+	static void Render(const Scene& scene, Framebuffer& framebuffer, const RenderSettings& settings, CheckpointWriter* checkpoints = nullptr) noexcept
 	{
-        std::atomic_uint32_t counter{ 0 };
-        std::vector<std::unique_ptr<RenderThread>> threads;
-        threads.reserve(settings.ThreadCount());
-
-        // Spawn a given number of worker threads, which will render individual scanlines
-        // of the final image. Each thread grabs the index of the next scanline to process
-        // from the atomic counter, avoiding any expensive synchronization.
-        for (uint32_t id = 0; id < settings.ThreadCount(); id++)
+        using Clock = std::chrono::steady_clock;
+
+        const auto start_time = Clock::now();
+        const auto deadline = settings.TimeLimit() > 0.0 ?
+            start_time + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(settings.TimeLimit())) :
+            Clock::time_point::max();
+
+        // Without progressive rendering or adaptive sampling, a single pass takes all the samples of each pixel.
+        // With adaptive sampling, no pixel can stop before having the minimum number of samples.
+        const bool adaptive = settings.NoiseThreshold() > 0.0;
+        const uint32_t target = settings.SampleTarget();
+        const uint32_t min_samples = std::max(std::min(settings.MinSamplesPerPixel(), target), 2u);
+        const bool multipass = settings.IsProgressive() || adaptive;
+
+        uint32_t pass_samples = settings.IsProgressive() ? settings.PassSamples() : (adaptive ? min_samples : target);
+        uint32_t first_pass_samples = adaptive ? std::max(pass_samples, min_samples) : pass_samples;
+
+        TileScheduler scheduler(framebuffer.GetWidth(), framebuffer.GetHeight(),
+            settings.TileSize(), settings.GetTileOrder(), settings.ThreadCount());
+
+        const uint32_t first_pass = framebuffer.GetPassCount();
+        const auto checkpoint_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(settings.CheckpointInterval()));
+        auto checkpoint_time = start_time;
+
+        uint32_t pass = first_pass;
+        bool time_is_up = false;
+
+        // A resumed render may already be done (the checkpoint keeps the pixels that stopped, unless the stop criteria changed).
+        bool done = !framebuffer.HasActivePixels();
+
+        while (!done)
         {
-            threads.emplace_back(std::make_unique<RenderThread>(id,
-                scene, image, settings.SamplesPerPixel(), settings.MaxBounces(), counter));
+            if (pass > first_pass)
+                scheduler.Restart();
+
+            std::vector<std::unique_ptr<RenderThread>> threads;
+            threads.reserve(settings.ThreadCount());
+
+            // Spawn a given number of worker threads, which will render individual tiles
+            // of the final image. Each thread works through its own queue of tiles and,
+            // once done, steals the remaining work from the other threads' queues.
+            for (uint32_t id = 0; id < settings.ThreadCount(); id++)
+            {
+                threads.emplace_back(std::make_unique<RenderThread>(id, scene, framebuffer, settings,
+                    pass, pass == 0 ? first_pass_samples : pass_samples, deadline, scheduler));
+            }
+
+            // Update the tile counter in the command line UI.
+            uint32_t value = 0;
+            while (value < scheduler.GetTileCount())
+            {
+                // Wait on the tile counter to be updated by worker threads.
+                value = scheduler.WaitProgress(value);
+                std::cout << "\rRendering " << (multipass ? "pass " + std::to_string(pass + 1) + ", " : "")
+                    << "tile " << value << '/' << scheduler.GetTileCount() << "   ";
+            }
+
+            // Join all render threads to avoid zombies.
+            for (const auto& thread : threads)
+                thread->Join();
+
+            // A pass cut short by the time limit is not counted, so that a resumed render first completes it
+            // for the pixels it skipped (and only then decides which pixels stop, as an uninterrupted one does).
+            if (Clock::now() >= deadline)
+            {
+                time_is_up = true;
+                break;
+            }
+
+            pass++;
+            framebuffer.SetPassCount(pass);
+
+            done = !framebuffer.UpdateActivePixels(target, min_samples, settings.NoiseThreshold());
+
+            // Only a copy of the framebuffer is taken here, it is written while the next pass renders.
+            if (checkpoints && !done && Clock::now() - checkpoint_time >= checkpoint_interval)
+            {
+                checkpoints->Submit(framebuffer);
+                checkpoint_time = Clock::now();
+            }
         }
 
-        // Update the scanline counter in the command line UI.
-        uint32_t value = 0;
-        while (value < image.GetHeight())
+        if (checkpoints)
         {
-            // Wait on the atomic counter to be updated by worker threads.
-            counter.wait(value);
-            value = counter.load();
-
-            const uint32_t scanline = std::min(value + 1, image.GetHeight());
-            std::cout << "\rRendering scanline " << scanline << '/' << image.GetHeight();
+            checkpoints->Submit(framebuffer);
+            checkpoints->Flush();
         }
 
-        // Join all render threads to avoid zombies.
-        for (const auto& thread : threads)
-            thread->Join();
+        scheduler.PrintStatistics();
+
+        if (multipass)
+        {
+            const uint64_t pixel_count = uint64_t(framebuffer.GetWidth()) * framebuffer.GetHeight();
+            std::cout << "Rendered " << pass - first_pass << " passes" << (first_pass ? " after resuming from pass " + std::to_string(first_pass) : "") << ", " << static_cast<double>(framebuffer.GetSampleCount()) / pixel_count
+                << " samples per pixel on average (min. " << framebuffer.GetMinSampleCount() << ", max. " << target << ")"
+                << (time_is_up ? ", stopped by the time limit" : "") << "\n";
+
+            if (framebuffer.GetMinSampleCount() == 0)
+                std::cerr << "WARNING: the time limit was reached before every pixel had a sample.\n";
+        }
 	}
 };
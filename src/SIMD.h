@@ -0,0 +1,53 @@
+#pragma once
+
+// Detect whether we are compiling for an x86 target, where SSE is always available
+// and wider instruction sets (AVX) can be used after checking the CPU at runtime.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define RT_SIMD_X86 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+// MSVC lets any function use any intrinsic, while GCC and Clang require the functions
+// using instructions beyond the compilation target to be explicitly marked as such.
+#if defined(RT_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define RT_TARGET_AVX __attribute__((target("avx")))
+#else
+    #define RT_TARGET_AVX
+#endif
+
+
+class CpuFeatures
+{
+public:
+
+    // Returns true if both the CPU and the operating system support AVX instructions.
+    static bool HasAVX() noexcept
+    {
+        static const bool supported = DetectAVX();
+        return supported;
+    }
+
+private:
+
+    static bool DetectAVX() noexcept
+    {
+#if defined(RT_SIMD_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+
+        // The CPU must support AVX (bit 28) and XSAVE must be enabled by the OS (bit 27),
+        // which must in turn save the YMM registers state on context switches.
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        return avx && osxsave && ((_xgetbv(0) & 0x6) == 0x6);
+#elif defined(RT_SIMD_X86)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx");
+#else
+        return false;
+#endif
+    }
+};
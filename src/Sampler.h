@@ -0,0 +1,357 @@
+#pragma once
+
+#include <array>
+#include <memory>
+
+#include "Common.h"
+
+
+enum class SamplerType
+{
+	Random,			// Independent random numbers
+	Stratified,		// Jittered strata, shuffled separately in each dimension
+	Sobol,			// Owen-scrambled Sobol (0,2)-sequence, in pairs of dimensions
+	BlueNoise		// Sobol sequence shared by all pixels, shifted by a blue noise mask
+};
+
+
+// Source of the numbers used for the random decisions of a pixel sample, which can be better distributed
+// than independent random numbers, to reach the same noise level with fewer samples per pixel.
+// Each decision along a path is assigned a fixed dimension by calling Seek() before it, and while a sampler
+// is installed with Random::SetSampler() all the numbers drawn from the Random class come from it,
+// until the dimensions given to Seek() run out and it falls back to its own random number generator.
+class Sampler
+{
+public:
+
+	// Layout of the dimensions: the camera ones first, then a fixed block for each bounce.
+	// 2D decisions start at even dimensions, to use the pairs stratified together by some samplers.
+	static constexpr uint32_t c_cameraDimension = 0;	// Pixel position (2), lens position (2), time (1)
+	static constexpr uint32_t c_cameraDimensions = 6;
+	static constexpr uint32_t c_bounceDimensions = 10;		// The last one is unused, so that the blocks start at even dimensions
+
+	enum BounceDimension : uint32_t
+	{
+		Scatter = 0,		// Material sampling (up to 3)
+		LightChoice = 3,	// Light picked for next event estimation (1)
+		LightPoint = 4,		// Point sampled on the light (2), preceded by the object picked within a prototype (1)
+		Roulette = 7,		// Russian roulette (1)
+		Medium = 8			// Distance travelled in participating media (1)
+	};
+
+protected:
+
+	const uint32_t m_sampleCount;
+	uint32_t m_pixelX = 0;
+	uint32_t m_pixelY = 0;
+	uint32_t m_sampleIndex = 0;
+	uint32_t m_dimension = 0;
+	uint32_t m_dimensionEnd = 0;
+
+public:
+
+	explicit Sampler(const uint32_t sample_count) noexcept
+		: m_sampleCount(sample_count > 0 ? sample_count : 1) {}
+
+	virtual ~Sampler() = default;
+
+	// Create a sampler for the given number of samples per pixel, or nullptr for independent random numbers.
+	static std::unique_ptr<Sampler> Create(const SamplerType type, const uint32_t sample_count);
+
+	void StartSample(const uint32_t x, const uint32_t y, const uint32_t sample_index) noexcept
+	{
+		m_pixelX = x;
+		m_pixelY = y;
+		m_sampleIndex = sample_index;
+		m_dimension = 0;
+		m_dimensionEnd = 0;
+	}
+
+	// Assign the next numbers drawn to the dimensions [first, first + count).
+	void Seek(const uint32_t first, const uint32_t count) noexcept
+	{
+		m_dimension = first;
+		m_dimensionEnd = first + count;
+	}
+
+	void SeekBounce(const uint32_t depth, const BounceDimension first, const uint32_t count) noexcept
+	{
+		Seek(c_cameraDimensions + depth * c_bounceDimensions + first, count);
+	}
+
+	// Returns the value in [0, 1) for the next dimension, or false if there are none left.
+	bool Next(double& value) noexcept
+	{
+		if (m_dimension >= m_dimensionEnd)
+			return false;
+
+		value = Sample(m_dimension++);
+		return true;
+	}
+
+protected:
+
+	// Value of the given dimension for the current pixel sample.
+	virtual double Sample(const uint32_t dimension) const noexcept = 0;
+
+	uint32_t PixelSeed() const noexcept
+	{
+		return HashCombine(Hash(m_pixelX), m_pixelY);
+	}
+
+	static double ToUnitDouble(const uint32_t bits) noexcept
+	{
+		return bits * 0x1.0p-32;
+	}
+
+	// Integer hash with a good avalanche effect ("lowbias32", by C. Wellons).
+	static uint32_t Hash(uint32_t x) noexcept
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	static uint32_t HashCombine(const uint32_t seed, const uint32_t value) noexcept
+	{
+		return Hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+	}
+
+	static uint32_t ReverseBits(uint32_t x) noexcept
+	{
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+		x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+		x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+		x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+		return x;
+	}
+
+	// Random permutation of the bits of a fixed point number in [0, 1), where each bit is flipped depending on
+	// the ones above it (Owen scrambling), which keeps the stratification of the Sobol sequence. This is the
+	// hash-based version by Laine and Karras, improved by Burley ("Practical Hash-based Owen Scrambling").
+	static uint32_t NestedUniformScramble(uint32_t x, const uint32_t seed) noexcept
+	{
+		x = ReverseBits(x);
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return ReverseBits(x);
+	}
+
+	// The first two dimensions of the Sobol sequence (the second uses the direction numbers v[i] = v[i-1] ^ (v[i-1] >> 1)).
+	static uint32_t Sobol(uint32_t index, const uint32_t dimension) noexcept
+	{
+		if (dimension == 0)
+			return ReverseBits(index);
+
+		uint32_t bits = 0;
+		for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+		{
+			if (index & 1)
+				bits ^= v;
+		}
+		return bits;
+	}
+
+	// Owen-scrambled Sobol point for a pair of dimensions, with the sample index shuffled by a different
+	// permutation for each pair, so that the pairs are not correlated with each other.
+	static uint32_t ScrambledSobol(const uint32_t index, const uint32_t dimension, const uint32_t seed) noexcept
+	{
+		const uint32_t pair_seed = HashCombine(seed, dimension >> 1);
+		const uint32_t shuffled_index = NestedUniformScramble(index, pair_seed);
+		return NestedUniformScramble(Sobol(shuffled_index, dimension & 1), HashCombine(pair_seed, 1 + (dimension & 1)));
+	}
+};
+
+
+class StratifiedSampler : public Sampler
+{
+public:
+
+	explicit StratifiedSampler(const uint32_t sample_count) noexcept
+		: Sampler(sample_count) {}
+
+protected:
+
+	// The samples of each pixel fall in different strata of each dimension, in a random order that changes
+	// with the dimension (a Latin hypercube), and at a random position within each stratum.
+	virtual double Sample(const uint32_t dimension) const noexcept override final
+	{
+		const uint32_t seed = HashCombine(PixelSeed(), dimension);
+		const uint32_t stratum = Permute(m_sampleIndex % m_sampleCount, m_sampleCount, seed);
+		const double jitter = ToUnitDouble(HashCombine(seed, m_sampleIndex));
+		return (stratum + jitter) / m_sampleCount;
+	}
+
+private:
+
+	// Random permutation of [0, count) computed without any table, by hashing the index within the next
+	// power of two and walking the cycle until it falls in range (Kensler, "Correlated Multi-Jittered Sampling").
+	static uint32_t Permute(uint32_t i, const uint32_t count, const uint32_t seed) noexcept
+	{
+		uint32_t w = count - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+
+		do
+		{
+			i ^= seed;
+			i *= 0xe170893du;
+			i ^= seed >> 16;
+			i ^= (i & w) >> 4;
+			i ^= seed >> 8;
+			i *= 0x0929eb3fu;
+			i ^= seed >> 23;
+			i ^= (i & w) >> 1;
+			i *= 1 | seed >> 27;
+			i *= 0x6935fa69u;
+			i ^= (i & w) >> 11;
+			i *= 0x74dcb303u;
+			i ^= (i & w) >> 2;
+			i *= 0x9e501cc3u;
+			i ^= (i & w) >> 2;
+			i *= 0xc860a3dfu;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= count);
+
+		return (i + seed) % count;
+	}
+};
+
+
+class SobolSampler : public Sampler
+{
+public:
+
+	explicit SobolSampler(const uint32_t sample_count) noexcept
+		: Sampler(sample_count) {}
+
+protected:
+
+	// Each pixel gets its own scrambling of the sequence, so the error is not correlated across pixels.
+	virtual double Sample(const uint32_t dimension) const noexcept override final
+	{
+		return ToUnitDouble(ScrambledSobol(m_sampleIndex, dimension, PixelSeed()));
+	}
+};
+
+
+class BlueNoiseSampler : public Sampler
+{
+private:
+
+	static constexpr uint32_t c_maskSize = 64;		// Must be a power of two
+
+public:
+
+	explicit BlueNoiseSampler(const uint32_t sample_count) noexcept
+		: Sampler(sample_count)
+	{
+		GetMask();		// Generate the mask before rendering, rather than in the first sample
+	}
+
+protected:
+
+	// All pixels use the same scrambled sequence, shifted (modulo 1) by a blue noise value different for each
+	// pixel, so that the remaining error is distributed as blue noise over the image rather than white noise,
+	// which looks much less noisy at low sample counts (Heitz and Belcour, "Distributing Monte Carlo Errors
+	// as a Blue Noise in Screen Space"). The mask is toroidally shifted by a different offset in each dimension.
+	virtual double Sample(const uint32_t dimension) const noexcept override final
+	{
+		const uint32_t offset = Hash(dimension);
+		const uint32_t x = (m_pixelX + offset) & (c_maskSize - 1);
+		const uint32_t y = (m_pixelY + (offset >> 16)) & (c_maskSize - 1);
+
+		const double value = ToUnitDouble(ScrambledSobol(m_sampleIndex, dimension, 0)) + GetMask()[y * c_maskSize + x];
+		return value < 1.0 ? value : value - 1.0;
+	}
+
+private:
+
+	// Tileable blue noise mask, with values uniformly distributed in [0, 1). It is generated by the void filling
+	// phase of the void-and-cluster method (Ulichney): pixels are ranked one at a time, always picking the one
+	// farthest from those already ranked, as measured by the sum of Gaussians centered on them.
+	static const std::array<double, c_maskSize * c_maskSize>& GetMask() noexcept
+	{
+		static const std::array<double, c_maskSize * c_maskSize> mask = []()
+		{
+			constexpr uint32_t count = c_maskSize * c_maskSize;
+			constexpr double sigma = 1.5;
+
+			std::vector<double> kernel(count);
+			for (uint32_t y = 0; y < c_maskSize; y++)
+			{
+				for (uint32_t x = 0; x < c_maskSize; x++)
+				{
+					const double dx = std::min(x, c_maskSize - x);
+					const double dy = std::min(y, c_maskSize - y);
+					kernel[y * c_maskSize + x] = std::exp(-(dx * dx + dy * dy) / (2.0 * sigma * sigma));
+				}
+			}
+
+			// Tiny random energies break the ties between the pixels, starting from the very first one.
+			Xoshiro256 generator(c_maskSize);
+			std::vector<double> energy(count);
+			for (double& e : energy)
+				e = static_cast<double>(generator() >> 11) * 0x1.0p-53 * 1e-6;
+
+			std::array<double, count> values;
+			std::vector<bool> ranked(count, false);
+
+			for (uint32_t rank = 0; rank < count; rank++)
+			{
+				uint32_t best = 0;
+				double best_energy = Infinity;
+				for (uint32_t i = 0; i < count; i++)
+				{
+					if (!ranked[i] && energy[i] < best_energy)
+					{
+						best = i;
+						best_energy = energy[i];
+					}
+				}
+
+				ranked[best] = true;
+				values[best] = (rank + 0.5) / count;
+
+				const uint32_t bx = best % c_maskSize;
+				const uint32_t by = best / c_maskSize;
+				for (uint32_t y = 0; y < c_maskSize; y++)
+				{
+					for (uint32_t x = 0; x < c_maskSize; x++)
+					{
+						const uint32_t kx = (x - bx) & (c_maskSize - 1);
+						const uint32_t ky = (y - by) & (c_maskSize - 1);
+						energy[y * c_maskSize + x] += kernel[ky * c_maskSize + kx];
+					}
+				}
+			}
+
+			return values;
+		}();
+
+		return mask;
+	}
+};
+
+
+inline std::unique_ptr<Sampler> Sampler::Create(const SamplerType type, const uint32_t sample_count)
+{
+	switch (type)
+	{
+		case SamplerType::Stratified: return std::make_unique<StratifiedSampler>(sample_count);
+		case SamplerType::Sobol:      return std::make_unique<SobolSampler>(sample_count);
+		case SamplerType::BlueNoise:  return std::make_unique<BlueNoiseSampler>(sample_count);
+		default:                      return nullptr;
+	}
+}
@@ -6,6 +6,9 @@
 #include "Sphere.h"
 #include "MovingSphere.h"
 #include "BVH.h"
+#include "WideBVH.h"
+#include "BVHCache.h"
+#include "Parallel.h"
 
 
 class Scene
@@ -15,35 +18,21 @@ public:
 	Color background;
 	Camera camera;
     std::vector<std::shared_ptr<Hittable>> objects;
-	std::shared_ptr<NodeBVH> bvh;
+	std::vector<const Hittable*> lights;		// Objects with an emissive material, sampled for direct lighting
+	std::vector<std::string> files;				// External files the objects were loaded from (e.g. meshes)
+	TraversalBVH bvh;
 
 public:
 
 	// Checks ray-object intersection for all objects in the scene list and returns the closest one to the camera.
 	bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit) const noexcept
 	{
-		if (bvh)
-		{
-			return bvh->Hit(ray, t_min, t_max, hit);
-		}
-		else
-		{
-			HitRecord last_hit;
-			bool hit_something = false;
-			double t_closest = t_max;
-
-			for (const auto& object : objects)
-			{
-				if (object->Hit(ray, t_min, t_closest, last_hit))
-				{
-					t_closest = last_hit.t;
-					hit_something = true;
-					hit = last_hit;
-				}
-			}
+		if (!FindClosestHit(ray, t_min, t_max, hit))
+			return false;
 
-			return hit_something;
-		}
+		// Only the closest hit needs its surface attributes (normal, UV, material...)
+		hit.object->SurfaceAttributes(ray, hit);
+		return true;
 	}
 
 
@@ -71,12 +60,149 @@ public:
 			object->BoundingBox(t_start, t_end, temp_box);
 			box = AABB::Combine(box, temp_box);
 		}
+
+		return true;
+	}
+
+
+	// Gathers all the emissive objects in the light list, which must be done again whenever the objects change.
+	void CollectLights() noexcept
+	{
+		lights.clear();
+		for (const auto& object : objects)
+		{
+			if (object->IsEmissive())
+				lights.push_back(object.get());
+		}
+	}
+
+
+	// Picks one of the lights uniformly at random, and a direction from the origin towards it.
+	const Hittable* SampleLight(const Point3& origin, const double time, Vector3& direction) const noexcept
+	{
+		const size_t index = std::min(static_cast<size_t>(Random::GetInteger(0, static_cast<int>(lights.size()) - 1)), lights.size() - 1);
+		direction = lights[index]->SampleDirection(origin, time);
+		return lights[index];
+	}
+
+
+	// Density of SampleLight() picking the given direction towards an object, which is zero if it is not a light.
+	// Only the object actually hit along the direction is considered, as any light behind it is occluded anyway.
+	double LightPdf(const Hittable* object, const Point3& origin, const Vector3& direction, const double time) const noexcept
+	{
+		if (!object->IsEmissive())
+			return 0.0;
+
+		return object->DirectionPdf(origin, direction, time) / lights.size();
 	}
 
 
 	// Builds Bounding Volume Hierarchy (BVH) structure for accelerating ray intersection tests.
-	void BuildBVH(const double t_start, const double t_end) noexcept
+	void BuildBVH(const double t_start, const double t_end, const BuildOptionsBVH& options = {})
+	{
+		const std::vector<AABB> bounds = CollectBounds(t_start, t_end, options);
+
+		bvh.GetBVH().Build(bounds, options);
+		SetMotionBVH(t_start, t_end, options);
+		bvh.Collapse(options.width);
+	}
+
+
+	// Loads the BVH from a cache file, if it was built with the given key for the objects of this scene.
+	bool LoadBVH(const std::string& cache_path, const uint64_t key, const BuildOptionsBVH& options = {})
+	{
+		if (!BVHCache::Load(cache_path, key, objects.size(), bvh.GetBVH()))
+			return false;
+
+		bvh.Collapse(options.width);
+		return true;
+	}
+
+
+	// Updates the BVH for a new shutter interval, refitting the existing hierarchy rather than building
+	// it from scratch, unless that degrades its quality too much. Returns true if the BVH was rebuilt.
+	bool RefitBVH(const double t_start, const double t_end, const BuildOptionsBVH& options = {})
+	{
+		BVH& binary = bvh.GetBVH();
+		if (binary.Empty() || binary.GetPrimitives().size() != objects.size())
+		{
+			BuildBVH(t_start, t_end, options);
+			return true;
+		}
+
+		const std::vector<AABB> bounds = CollectBounds(t_start, t_end, options);
+
+		binary.Refit(bounds);
+
+		// Objects that moved apart make the nodes above them larger and overlap more with their
+		// siblings, so refitting over and over can end up with a hierarchy much slower to traverse.
+		const bool rebuild = binary.Cost() > options.rebuild_threshold * binary.GetBuildCost();
+		if (rebuild)
+			binary.Build(bounds, options);
+
+		SetMotionBVH(t_start, t_end, options);
+		bvh.Collapse(options.width);
+		return rebuild;
+	}
+
+private:
+
+	bool FindClosestHit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit) const noexcept
+	{
+		if (!bvh.GetBVH().Empty())
+		{
+			// Hittable objects only write the hit record when they report an intersection,
+			// which is always closer than any previous one thanks to the shrinking t_max.
+			const auto intersect = [&](uint32_t index, const double t_lower, double& t_closest) -> bool
+			{
+				if (!objects[index]->Hit(ray, t_lower, t_closest, hit))
+					return false;
+
+				t_closest = hit.t;
+				return true;
+			};
+
+			return bvh.Hit(ray, t_min, t_max, intersect);
+		}
+		else
+		{
+			bool hit_something = false;
+			double t_closest = t_max;
+
+			for (const auto& object : objects)
+			{
+				if (object->Hit(ray, t_min, t_closest, hit))
+				{
+					t_closest = hit.t;
+					hit_something = true;
+				}
+			}
+
+			return hit_something;
+		}
+	}
+
+	std::vector<AABB> CollectBounds(const double t_start, const double t_end, const BuildOptionsBVH& options) const
+	{
+		std::vector<AABB> bounds(objects.size());
+
+		ParallelFor(0, objects.size(), options.thread_count, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (!objects[i]->BoundingBox(t_start, t_end, bounds[i]))
+					std::cerr << "No bounding box for scene object " << i << ".\n";
+			}
+		});
+
+		return bounds;
+	}
+
+	void SetMotionBVH(const double t_start, const double t_end, const BuildOptionsBVH& options)
 	{
-		bvh = std::make_shared<NodeBVH>(objects, 0, objects.size(), t_start, t_end);
+		// The hierarchy is built over the bounds of the objects during the whole shutter interval,
+		// while the traversal only needs to test their (much smaller) bounds at the time of each ray.
+		if (t_end > t_start)
+			bvh.GetBVH().SetMotion(CollectBounds(t_start, t_start, options), CollectBounds(t_end, t_end, options), t_start, t_end);
 	}
 };
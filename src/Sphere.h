@@ -3,6 +3,7 @@
 #include "Common.h"
 #include "Hittable.h"
 #include "Material.h"
+#include "ONB.h"
 
 
 class Sphere : public Hittable
@@ -54,16 +55,22 @@ public:
                 return false;
         }
 
-        // Fill the HitRecord structure with all the info about the intersection.
         hit.t = root;
+        hit.object = this;
+        return true;
+    }
+
+
+    // Fill the HitRecord structure with all the info about the intersection.
+    virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+        const noexcept override final
+    {
         hit.point = ray.At(hit.t);
         const Vector3 outward_normal = (hit.point - center) / radius;
         GetSphereUV(outward_normal, hit.u, hit.v);
         hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
         hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
         hit.material = material.get();
-
-        return true;
     }
 
 
@@ -75,4 +82,48 @@ public:
                    center + Point3(radius, radius, radius));
         return true;
     }
+
+
+    virtual bool IsEmissive() const noexcept override final
+    {
+        return material->IsEmissive();
+    }
+
+
+    // Directions are sampled uniformly within the cone subtended by the sphere, which has a constant density.
+    virtual double DirectionPdf(const Point3& origin, const Vector3& direction, const double time)
+        const noexcept override final
+    {
+        HitRecord hit;
+        if (!Hit(Ray(origin, direction, time), 0.001, Infinity, hit))
+            return 0.0;
+
+        // There is no cone when the origin lies inside the sphere, which then cannot be sampled.
+        const double sqr_distance = (center - origin).SqrLength();
+        if (sqr_distance <= radius * radius)
+            return 0.0;
+
+        const double cos_theta_max = std::sqrt(1.0 - radius * radius / sqr_distance);
+        return 1.0 / (2.0 * PI * (1.0 - cos_theta_max));
+    }
+
+
+    virtual Vector3 SampleDirection(const Point3& origin, const double /*time*/)
+        const noexcept override final
+    {
+        const Vector3 to_center = center - origin;
+        const double sqr_distance = to_center.SqrLength();
+        if (sqr_distance <= radius * radius)
+            return to_center;
+
+        // Pick a direction in the cone around the Z axis, with cos(theta) uniform in [cos_theta_max, 1].
+        const double cos_theta_max = std::sqrt(1.0 - radius * radius / sqr_distance);
+        const double cos_theta = 1.0 + Random::GetDouble(0.0, 1.0) * (cos_theta_max - 1.0);
+        const double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+        const double phi = 2.0 * PI * Random::GetDouble(0.0, 1.0);
+
+        // Then rotate it around the direction towards the center of the sphere.
+        const ONB uvw(Vector3::Normalized(to_center));
+        return uvw.Local(Vector3(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta));
+    }
 };
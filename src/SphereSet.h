@@ -0,0 +1,246 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "Common.h"
+#include "Hittable.h"
+#include "Material.h"
+#include "Sphere.h"
+#include "WideBVH.h"
+#include "BVHCache.h"
+#include "SIMD.h"
+
+
+// Set of static spheres stored as a structure of arrays, sorted in the order of the leaves of its own BVH, so that
+// the spheres of a leaf are contiguous and can be tested against a ray several at once with SIMD instructions.
+// It stands in for many separate Sphere objects, without their heap allocations and virtual calls.
+class SphereSet : public Hittable
+{
+public:
+
+	static constexpr uint32_t c_lanes = 4;					// Spheres tested at once (AVX, in double precision)
+	static constexpr uint32_t c_leafSize = 2 * c_lanes;		// Maximum number of spheres in a leaf
+
+private:
+
+	// The arrays are padded with c_lanes more spheres, so that the last leaf can always be loaded in full.
+	std::vector<double>   m_centerX;
+	std::vector<double>   m_centerY;
+	std::vector<double>   m_centerZ;
+	std::vector<double>   m_radius;
+	std::vector<uint32_t> m_material;			// Index in the materials array
+
+	std::vector<std::shared_ptr<Material>> m_materials;
+	TraversalBVH m_bvh;
+	AABB         m_bounds;
+	bool         m_useAVX = false;
+
+public:
+
+	SphereSet(const std::vector<std::shared_ptr<Sphere>>& spheres, BuildOptionsBVH options = {})
+		: m_bounds(AABB::Empty())
+	{
+		std::vector<AABB> bounds(spheres.size());
+		for (size_t i = 0; i < spheres.size(); i++)
+		{
+			spheres[i]->BoundingBox(0.0, 0.0, bounds[i]);
+			m_bounds = AABB::Combine(m_bounds, bounds[i]);
+		}
+
+		BVH& bvh = m_bvh.GetBVH();
+		options.max_leaf_size = c_leafSize;
+		BVHCache::BuildObject(bvh, bounds, options);
+
+		// Store the spheres in the order in which the leaves reference them, sharing the materials used more than once.
+		std::unordered_map<const Material*, uint32_t> material_indices;
+		const size_t count = spheres.size() + c_lanes;
+		m_centerX.reserve(count);
+		m_centerY.reserve(count);
+		m_centerZ.reserve(count);
+		m_radius.reserve(count);
+		m_material.reserve(count);
+
+		for (const uint32_t index : bvh.GetPrimitives())
+		{
+			const Sphere& sphere = *spheres[index];
+			const auto [it, inserted] = material_indices.try_emplace(sphere.material.get(), static_cast<uint32_t>(m_materials.size()));
+			if (inserted)
+				m_materials.push_back(sphere.material);
+
+			m_centerX.push_back(sphere.center.x());
+			m_centerY.push_back(sphere.center.y());
+			m_centerZ.push_back(sphere.center.z());
+			m_radius.push_back(sphere.radius);
+			m_material.push_back(it->second);
+		}
+
+		m_centerX.resize(count, 0.0);
+		m_centerY.resize(count, 0.0);
+		m_centerZ.resize(count, 0.0);
+		m_radius.resize(count, 0.0);
+		m_material.resize(count, 0);
+
+		// The wide hierarchy keeps the leaves of the binary one, so they still reference contiguous spheres.
+		m_bvh.Collapse(options.width);
+		m_useAVX = CpuFeatures::HasAVX();
+	}
+
+
+	uint32_t GetSphereCount() const noexcept
+	{
+		return static_cast<uint32_t>(m_radius.size() - c_lanes);
+	}
+
+
+	// Ray-spheres intersection checking, recording the index of the sphere hit as the primitive.
+	virtual bool Hit(const Ray& ray, const double t_min, const double t_max, HitRecord& hit)
+		const noexcept override final
+	{
+		const double a = ray.direction.SqrLength();
+
+		const auto intersect = [&](const uint32_t first, const uint32_t count, const double t_lower, double& t_closest)
+		{
+			uint32_t index = 0;
+#if defined(RT_SIMD_X86)
+			const bool found = m_useAVX ?
+				IntersectAVX(ray, a, first, count, t_lower, t_closest, index) :
+				IntersectScalar(ray, a, first, count, t_lower, t_closest, index);
+#else
+			const bool found = IntersectScalar(ray, a, first, count, t_lower, t_closest, index);
+#endif
+			if (!found)
+				return false;
+
+			hit.t = t_closest;
+			hit.object = this;
+			hit.primitive_id = index;
+			return true;
+		};
+
+		return m_bvh.HitLeaves(ray, t_min, t_max, intersect);
+	}
+
+
+	// Fill the HitRecord structure with all the info about the intersection, as Sphere does.
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
+		const uint32_t i = hit.primitive_id;
+		const Point3 center(m_centerX[i], m_centerY[i], m_centerZ[i]);
+
+		hit.point = ray.At(hit.t);
+		const Vector3 outward_normal = (hit.point - center) / m_radius[i];
+		GetSphereUV(outward_normal, hit.u, hit.v);
+		hit.is_front_face = Vector3::Dot(ray.direction, outward_normal) < 0.0;
+		hit.normal = hit.is_front_face ? outward_normal : -outward_normal;
+		hit.material = m_materials[m_material[i]].get();
+	}
+
+
+	virtual bool BoundingBox(const double /*t_start*/, const double /*t_end*/, AABB& box)
+		const noexcept override final
+	{
+		box = m_bounds;
+		return GetSphereCount() > 0;
+	}
+
+private:
+
+	// Test the spheres [first, first + count) one at a time, exactly as Sphere::Hit() does.
+	bool IntersectScalar(const Ray& ray, const double a, const uint32_t first, const uint32_t count,
+		const double t_min, double& t_max, uint32_t& index) const noexcept
+	{
+		bool found = false;
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const Vector3 oc = ray.origin - Point3(m_centerX[i], m_centerY[i], m_centerZ[i]);
+			const double h = Vector3::Dot(oc, ray.direction);
+			const double c = oc.SqrLength() - m_radius[i] * m_radius[i];
+			const double discriminant = h * h - a * c;
+
+			if (discriminant < 0)
+				continue;
+			const double sqrtd = std::sqrt(discriminant);
+
+			double root = (-h - sqrtd) / a;
+			if ((root < t_min) | (root > t_max))
+			{
+				root = (-h + sqrtd) / a;
+				if ((root < t_min) | (t_max < root))
+					continue;
+			}
+
+			t_max = root;
+			index = i;
+			found = true;
+		}
+		return found;
+	}
+
+#if defined(RT_SIMD_X86)
+	// Test the spheres [first, first + count) in groups of four, with the same operations as the scalar version.
+	RT_TARGET_AVX bool IntersectAVX(const Ray& ray, const double a, const uint32_t first, const uint32_t count,
+		const double t_min, double& t_max, uint32_t& index) const noexcept
+	{
+		const __m256d origin_x = _mm256_set1_pd(ray.origin.x());
+		const __m256d origin_y = _mm256_set1_pd(ray.origin.y());
+		const __m256d origin_z = _mm256_set1_pd(ray.origin.z());
+		const __m256d direction_x = _mm256_set1_pd(ray.direction.x());
+		const __m256d direction_y = _mm256_set1_pd(ray.direction.y());
+		const __m256d direction_z = _mm256_set1_pd(ray.direction.z());
+		const __m256d a4 = _mm256_set1_pd(a);
+		const __m256d t_min4 = _mm256_set1_pd(t_min);
+		const __m256d sign = _mm256_set1_pd(-0.0);
+		const __m256d zero = _mm256_setzero_pd();
+		const __m256d lanes = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+
+		bool found = false;
+		for (uint32_t i = first; i < first + count; i += c_lanes)
+		{
+			const __m256d oc_x = _mm256_sub_pd(origin_x, _mm256_loadu_pd(&m_centerX[i]));
+			const __m256d oc_y = _mm256_sub_pd(origin_y, _mm256_loadu_pd(&m_centerY[i]));
+			const __m256d oc_z = _mm256_sub_pd(origin_z, _mm256_loadu_pd(&m_centerZ[i]));
+			const __m256d radius = _mm256_loadu_pd(&m_radius[i]);
+
+			const __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(oc_x, direction_x), _mm256_mul_pd(oc_y, direction_y)), _mm256_mul_pd(oc_z, direction_z));
+			const __m256d sqr_length = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(oc_x, oc_x), _mm256_mul_pd(oc_y, oc_y)), _mm256_mul_pd(oc_z, oc_z));
+			const __m256d c = _mm256_sub_pd(sqr_length, _mm256_mul_pd(radius, radius));
+			const __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a4, c));
+
+			// Skip the square roots and divisions when the ray misses all the spheres, which is the most common case.
+			const __m256d in_leaf = _mm256_cmp_pd(lanes, _mm256_set1_pd(double(first + count - i)), _CMP_LT_OQ);
+			if (_mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ), in_leaf)) == 0)
+				continue;
+
+			// A negative discriminant gives a NaN square root, and roots that fail all the (ordered) comparisons below.
+			const __m256d sqrtd = _mm256_sqrt_pd(discriminant);
+			const __m256d minus_h = _mm256_xor_pd(h, sign);
+			const __m256d near_root = _mm256_div_pd(_mm256_sub_pd(minus_h, sqrtd), a4);
+			const __m256d far_root = _mm256_div_pd(_mm256_add_pd(minus_h, sqrtd), a4);
+
+			const __m256d t_max4 = _mm256_set1_pd(t_max);
+			const __m256d near_valid = _mm256_and_pd(_mm256_cmp_pd(near_root, t_min4, _CMP_GE_OQ), _mm256_cmp_pd(near_root, t_max4, _CMP_LE_OQ));
+			const __m256d far_valid = _mm256_and_pd(_mm256_cmp_pd(far_root, t_min4, _CMP_GE_OQ), _mm256_cmp_pd(far_root, t_max4, _CMP_LE_OQ));
+
+			int mask = _mm256_movemask_pd(_mm256_and_pd(_mm256_or_pd(near_valid, far_valid), in_leaf));
+			if (mask == 0)
+				continue;
+
+			alignas(32) double roots[c_lanes];
+			_mm256_store_pd(roots, _mm256_blendv_pd(far_root, near_root, near_valid));
+
+			// Pick the closest of the spheres hit, taking the last one on ties like the sequential tests do.
+			for (uint32_t lane = 0; lane < c_lanes; lane++, mask >>= 1)
+			{
+				if ((mask & 1) && roots[lane] <= t_max)
+				{
+					t_max = roots[lane];
+					index = i + lane;
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+#endif
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+#include "Common.h"
+
+
+// A rectangular region of the image, rendered as a single unit of work.
+struct Tile
+{
+    uint32_t index = 0;         // Position of the tile in the global tile ordering
+    uint32_t x0 = 0, y0 = 0;    // Upper-left pixel (inclusive)
+    uint32_t x1 = 0, y1 = 0;    // Lower-right pixel (exclusive)
+};
+
+
+enum class TileOrder
+{
+    Scanline,       // Row-major, top to bottom
+    Morton,         // Z-order curve over the tile grid
+    Spiral          // Square spiral growing outwards from the image center
+};
+
+
+class TileScheduler
+{
+private:
+
+    // Work queue owned by a single render thread, other threads can steal from its back.
+    struct alignas(64) WorkQueue
+    {
+        std::mutex           mutex;
+        std::deque<uint32_t> tiles;
+        uint32_t             rendered = 0;
+        uint32_t             stolen = 0;
+    };
+
+    std::vector<Tile>       m_tiles;
+    std::vector<double>     m_tileTimes;        // Render time of each tile (in seconds)
+    std::vector<WorkQueue>  m_queues;
+    std::atomic_uint32_t    m_completed{ 0 };
+
+public:
+
+    TileScheduler(const uint32_t width, const uint32_t height, const uint32_t tile_size,
+        const TileOrder order, const uint32_t thread_count)
+        : m_queues(thread_count)
+    {
+        const uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+        const uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+
+        // Generate the tiles grid coordinates following the requested ordering, then
+        // convert them into pixel regions (tiles along the borders may be smaller).
+        for (const auto& [tx, ty] : OrderTiles(tiles_x, tiles_y, order))
+        {
+            Tile tile;
+            tile.index = static_cast<uint32_t>(m_tiles.size());
+            tile.x0 = tx * tile_size;
+            tile.y0 = ty * tile_size;
+            tile.x1 = std::min(tile.x0 + tile_size, width);
+            tile.y1 = std::min(tile.y0 + tile_size, height);
+            m_tiles.push_back(tile);
+        }
+
+        m_tileTimes.resize(m_tiles.size(), 0.0);
+
+        FillQueues();
+    }
+
+
+    // Queue all the tiles again, for another rendering pass over the whole image.
+    // The statistics keep accumulating over all the passes.
+    void Restart() noexcept
+    {
+        FillQueues();
+        m_completed.store(0);
+    }
+
+
+    uint32_t GetTileCount() const noexcept
+    {
+        return static_cast<uint32_t>(m_tiles.size());
+    }
+
+    uint32_t GetCompletedCount() const noexcept
+    {
+        return m_completed.load();
+    }
+
+
+    // Fetch the next tile to be rendered by the given thread, returns false when there is no work left.
+    bool Next(const uint32_t thread_id, Tile& tile) noexcept
+    {
+        // Take work from the front of the thread's own queue first.
+        {
+            WorkQueue& queue = m_queues[thread_id];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tiles.empty())
+            {
+                tile = m_tiles[queue.tiles.front()];
+                queue.tiles.pop_front();
+                return true;
+            }
+        }
+
+        // Otherwise steal from the back of another thread's queue, which is the work
+        // furthest away from what its owner is rendering at the moment.
+        const uint32_t thread_count = static_cast<uint32_t>(m_queues.size());
+        for (uint32_t i = 1; i < thread_count; i++)
+        {
+            WorkQueue& victim = m_queues[(thread_id + i) % thread_count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tiles.empty())
+            {
+                tile = m_tiles[victim.tiles.back()];
+                victim.tiles.pop_back();
+                m_queues[thread_id].stolen++;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    // Mark a tile as completed, recording how long it took to render it.
+    void Complete(const uint32_t thread_id, const Tile& tile, const double seconds) noexcept
+    {
+        m_tileTimes[tile.index] += seconds;
+        m_queues[thread_id].rendered++;
+
+        // Notify the main thread that another tile has been rendered.
+        m_completed.fetch_add(1);
+        m_completed.notify_all();
+    }
+
+
+    // Block the calling thread until the number of completed tiles differs from the given value.
+    uint32_t WaitProgress(const uint32_t value) const noexcept
+    {
+        m_completed.wait(value);
+        return m_completed.load();
+    }
+
+
+    void PrintStatistics() const noexcept
+    {
+        if (m_tiles.empty())
+            return;
+
+        std::vector<uint32_t> sorted(m_tiles.size());
+        for (uint32_t i = 0; i < sorted.size(); i++)
+            sorted[i] = i;
+
+        std::sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b)
+            { return m_tileTimes[a] < m_tileTimes[b]; });
+
+        double total = 0.0;
+        for (const double time : m_tileTimes)
+            total += time;
+
+        const auto percentile = [&](double p) -> double
+        {
+            return m_tileTimes[sorted[static_cast<size_t>(p * (sorted.size() - 1))]];
+        };
+
+        const Tile& slowest = m_tiles[sorted.back()];
+
+        std::cout << "\n\nTILE STATISTICS:\n\n" << std::fixed << std::setprecision(4)
+            << " Tiles: \t\t"       << m_tiles.size()                       << '\n'
+            << " Min. Time: \t\t"   << percentile(0.0)  << "s"              << '\n'
+            << " Avg. Time: \t\t"   << total / m_tiles.size() << "s"        << '\n'
+            << " Median Time: \t\t" << percentile(0.5)  << "s"              << '\n'
+            << " 95th Perc.: \t\t"  << percentile(0.95) << "s"              << '\n'
+            << " Max. Time: \t\t"   << percentile(1.0)  << "s"
+            << " (tile at " << slowest.x0 << ',' << slowest.y0 << ")"       << '\n';
+
+        for (size_t t = 0; t < m_queues.size(); t++)
+        {
+            std::cout << " Thread " << t << ": \t\t" << m_queues[t].rendered << " tiles ("
+                << m_queues[t].stolen << " stolen)\n";
+        }
+
+        std::cout << std::defaultfloat << std::setprecision(6);
+    }
+
+private:
+
+    static std::vector<std::pair<uint32_t, uint32_t>> OrderTiles(const uint32_t tiles_x, const uint32_t tiles_y, const TileOrder order)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> coords;
+        coords.reserve(size_t(tiles_x) * tiles_y);
+
+        switch (order)
+        {
+            case TileOrder::Morton:
+            {
+                for (uint32_t ty = 0; ty < tiles_y; ty++)
+                    for (uint32_t tx = 0; tx < tiles_x; tx++)
+                        coords.emplace_back(tx, ty);
+
+                // Sort the tiles along the Z-order curve, the grid is not necessarily
+                // a power of two in size so the curve is simply clipped to the image.
+                std::sort(coords.begin(), coords.end(), [](const auto& a, const auto& b)
+                    { return EncodeMorton2(a.first, a.second) < EncodeMorton2(b.first, b.second); });
+                break;
+            }
+
+            case TileOrder::Spiral:
+            {
+                // Walk a square spiral starting from the central tile, keeping only the
+                // steps that fall inside the grid, until every tile has been visited.
+                int x = static_cast<int>(tiles_x - 1) / 2;
+                int y = static_cast<int>(tiles_y - 1) / 2;
+                int dx = 1, dy = 0;
+                int leg_length = 1;
+
+                const size_t count = size_t(tiles_x) * tiles_y;
+                while (coords.size() < count)
+                {
+                    for (int leg = 0; leg < 2; leg++)
+                    {
+                        for (int step = 0; step < leg_length; step++)
+                        {
+                            if (x >= 0 && y >= 0 && x < int(tiles_x) && y < int(tiles_y))
+                                coords.emplace_back(uint32_t(x), uint32_t(y));
+                            x += dx;
+                            y += dy;
+                        }
+
+                        // Turn 90 degrees
+                        std::swap(dx, dy);
+                        dx = -dx;
+                    }
+                    leg_length++;
+                }
+                break;
+            }
+
+            default:
+            {
+                for (uint32_t ty = 0; ty < tiles_y; ty++)
+                    for (uint32_t tx = 0; tx < tiles_x; tx++)
+                        coords.emplace_back(tx, ty);
+                break;
+            }
+        }
+
+        return coords;
+    }
+
+    // Interleave the lower 16 bits of x and y into a 32-bit Morton code.
+    static uint32_t EncodeMorton2(uint32_t x, uint32_t y) noexcept
+    {
+        const auto spread = [](uint32_t v) -> uint32_t
+        {
+            v &= 0x0000FFFF;
+            v = (v | (v << 8)) & 0x00FF00FF;
+            v = (v | (v << 4)) & 0x0F0F0F0F;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
+
+
+    void FillQueues() noexcept
+    {
+        // Give each thread a contiguous run of the ordered tiles, so that consecutive tiles
+        // rendered by the same thread are also close in the image (and in the scene).
+        const size_t count = m_tiles.size();
+        const size_t thread_count = m_queues.size();
+        for (size_t t = 0; t < thread_count; t++)
+        {
+            const size_t begin = t * count / thread_count;
+            const size_t end = (t + 1) * count / thread_count;
+            for (size_t i = begin; i < end; i++)
+                m_queues[t].tiles.push_back(static_cast<uint32_t>(i));
+        }
+    }
+};
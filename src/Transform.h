@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cmath>
+
+#include "Common.h"
+#include "AABB.h"
+
+
+// Affine transform, stored as the top 3 rows of a 4x4 matrix: a linear part (rotation, scale, shear)
+// in the first 3 columns, followed by the translation. Transforms are composed like matrices, so that
+// (A * B) applies B first and then A.
+class Transform
+{
+public:
+
+	double m[3][4];
+
+public:
+
+	constexpr Transform() noexcept
+		: m{ { 1.0, 0.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0, 0.0 }, { 0.0, 0.0, 1.0, 0.0 } }
+	{}
+
+
+	static constexpr Transform Identity() noexcept
+	{
+		return Transform();
+	}
+
+	static constexpr Transform Translation(const Vector3& offset) noexcept
+	{
+		Transform t;
+		for (int i = 0; i < 3; i++)
+			t.m[i][3] = offset[i];
+		return t;
+	}
+
+	static constexpr Transform Scale(const Vector3& factors) noexcept
+	{
+		Transform t;
+		for (int i = 0; i < 3; i++)
+			t.m[i][i] = factors[i];
+		return t;
+	}
+
+	// Counterclockwise rotation (looking down the axis towards the origin) around the X, Y or Z axis, in degrees.
+	static Transform Rotation(const int axis, const double angle) noexcept
+	{
+		const double radians = Deg2Rad(angle);
+		const double sin_theta = std::sin(radians);
+		const double cos_theta = std::cos(radians);
+		const int a = (axis + 1) % 3;
+		const int b = (axis + 2) % 3;
+
+		Transform t;
+		t.m[a][a] = cos_theta;
+		t.m[a][b] = -sin_theta;
+		t.m[b][a] = sin_theta;
+		t.m[b][b] = cos_theta;
+		return t;
+	}
+
+
+	constexpr Transform operator*(const Transform& other) const noexcept
+	{
+		Transform t;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				t.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j];
+				if (j == 3)
+					t.m[i][j] += m[i][3];
+			}
+		}
+		return t;
+	}
+
+
+	constexpr Point3 ApplyToPoint(const Point3& p) const noexcept
+	{
+		return Point3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+			m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+			m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+	}
+
+	// Directions are only affected by the linear part.
+	constexpr Vector3 ApplyToVector(const Vector3& v) const noexcept
+	{
+		return Vector3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+			m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+			m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+	}
+
+	// Bounds of the transformed box (Arvo, "Transforming Axis-Aligned Bounding Boxes"): on each axis, every
+	// column of the linear part moves the bounds by the smallest and largest of its products with the corners.
+	AABB ApplyToBox(const AABB& box) const noexcept
+	{
+		Point3 min, max;
+		for (int i = 0; i < 3; i++)
+		{
+			min[i] = max[i] = m[i][3];
+			for (int j = 0; j < 3; j++)
+			{
+				const double a = m[i][j] * box.min[j];
+				const double b = m[i][j] * box.max[j];
+				min[i] += std::min(a, b);
+				max[i] += std::max(a, b);
+			}
+		}
+		return AABB(min, max);
+	}
+
+
+	constexpr double Determinant() const noexcept
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+	// Inverse transform, which only exists if the determinant is not zero.
+	constexpr Transform Inverse() const noexcept
+	{
+		// The inverse of the linear part is its adjugate divided by the determinant, and the
+		// inverse translation is the original one brought back through the inverse linear part.
+		const double inv_det = 1.0 / Determinant();
+
+		Transform t;
+		for (int i = 0; i < 3; i++)
+		{
+			const int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+			for (int j = 0; j < 3; j++)
+			{
+				const int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+				t.m[j][i] = (m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1]) * inv_det;
+			}
+		}
+
+		for (int i = 0; i < 3; i++)
+			t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+
+		return t;
+	}
+
+	// Transform of the surface normals: the transpose of the inverse of the linear part, without translation,
+	// which keeps them perpendicular to the transformed surfaces even under non-uniform scaling.
+	constexpr Transform NormalTransform() const noexcept
+	{
+		const Transform inverse = Inverse();
+
+		Transform t;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				t.m[i][j] = inverse.m[j][i];
+		return t;
+	}
+
+
+	constexpr bool IsIdentity() const noexcept
+	{
+		return IsDiagonal() && m[0][0] == 1.0 && m[1][1] == 1.0 && m[2][2] == 1.0 &&
+			m[0][3] == 0.0 && m[1][3] == 0.0 && m[2][3] == 0.0;
+	}
+
+	// True if the linear part only scales along the axes, which keeps axis-aligned shapes aligned.
+	constexpr bool IsDiagonal() const noexcept
+	{
+		return m[0][1] == 0.0 && m[0][2] == 0.0 && m[1][0] == 0.0 &&
+			m[1][2] == 0.0 && m[2][0] == 0.0 && m[2][1] == 0.0;
+	}
+};
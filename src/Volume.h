@@ -61,11 +61,18 @@ public:
 			return false;
 
 		hit.t = hit1.t + hit_distance / ray_length;
+		hit.object = this;
+		return true;
+	}
+
+
+	virtual void SurfaceAttributes(const Ray& ray, HitRecord& hit)
+		const noexcept override final
+	{
 		hit.point = ray.At(hit.t);
 		hit.normal = Vector3(1, 0, 0);			// arbitrary
 		hit.is_front_face = true;				// also arbitrary
 		hit.material = phase_function.get();
-		return true;
 	}
 
 
@@ -0,0 +1,514 @@
+#pragma once
+
+#include <mutex>
+
+#include "Common.h"
+#include "SIMD.h"
+#include "BVH.h"
+
+
+// Node of an N-wide BVH, with the bounds of all the children stored in structure-of-arrays
+// layout so that a ray can be tested against all of them at once with SIMD instructions.
+template <int N>
+struct alignas(32) NodeWideBVH
+{
+	float    bounds[6][N];		// Child bounds: min x, y, z followed by max x, y, z
+	uint32_t offset[N];			// Interior child: index of the node, Leaf child: index of the first primitive
+	uint16_t count[N];			// Number of primitives in a leaf child (0 for interior and empty children)
+
+	bool IsLeaf(const int i) const noexcept { return count[i] > 0; }
+};
+
+
+// Motion of the children of an N-wide node, as offsets between their bounds at shutter close and open
+// (empty slots have no offsets, so they keep inverted bounds at any time).
+template <int N>
+struct alignas(32) NodeMotionWideBVH
+{
+	float bounds[6][N];
+};
+
+
+// Ray data shared by all the ray-node tests during a traversal.
+struct TraversalRay
+{
+	float origin[3];
+	float inv_direction[3];
+	int   near_plane[3];		// Index of the bounds row that holds the near plane on each axis
+	int   far_plane[3];
+
+	TraversalRay(const Ray& ray) noexcept
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a] = float(ray.origin[a]);
+			inv_direction[a] = float(1.0 / ray.direction[a]);
+
+			// With a negative direction the ray enters the slab through its max plane.
+			const bool negative = inv_direction[a] < 0.0f;
+			near_plane[a] = negative ? a + 3 : a;
+			far_plane[a] = negative ? a : a + 3;
+		}
+	}
+};
+
+
+// BVH with N children per node, obtained by collapsing the levels of a binary BVH.
+// The leaves keep the same primitive ranges of the source hierarchy.
+template <int N>
+class WideBVH
+{
+public:
+
+	using Node = NodeWideBVH<N>;
+	using NodeMotion = NodeMotionWideBVH<N>;
+
+	static constexpr int c_stackSize = BVH::c_maxDepth * (N - 1) + 1;
+
+private:
+
+	std::vector<Node>       m_nodes;
+	std::vector<NodeMotion> m_motion;		// Parallel to the nodes, only present if the source BVH has motion
+	std::vector<uint32_t>   m_primitives;
+	MotionIntervalBVH       m_motionInterval;
+
+public:
+
+	bool Empty() const noexcept { return m_nodes.empty(); }
+
+	const std::vector<Node>& GetNodes() const noexcept { return m_nodes; }
+
+
+	// Build the wide hierarchy by collapsing the nodes of an existing binary BVH.
+	void Build(const BVH& bvh)
+	{
+		m_nodes.clear();
+		m_motion.clear();
+		m_primitives.assign(bvh.GetPrimitives().begin(), bvh.GetPrimitives().end());
+		m_motionInterval = bvh.GetMotionInterval();
+
+		if (bvh.Empty())
+			return;
+
+		const std::span<const NodeBVH> binary_nodes = bvh.GetNodes();
+		const std::span<const NodeMotionBVH> binary_motion = bvh.GetMotion();
+		m_nodes.reserve(binary_nodes.size() / 2 + 1);
+		if (!binary_motion.empty())
+			m_motion.reserve(binary_nodes.size() / 2 + 1);
+
+		if (binary_nodes[0].IsLeaf())
+		{
+			// Degenerate case, the whole hierarchy is a single leaf.
+			const uint32_t root = 0;
+			AddNode(!binary_motion.empty());
+			SetChildren(binary_nodes, binary_motion, 0, &root, 1);
+		}
+		else
+		{
+			Collapse(binary_nodes, binary_motion, 0);
+		}
+	}
+
+
+	/* Find the closest intersection between a ray and the primitives in the hierarchy.
+		@param intersect  Callable as bool(uint32_t primitive, double t_min, double& t_max), which
+		                  tests the given primitive and, on a hit, shrinks t_max to the hit distance.
+	*/
+	template <typename IntersectFn>
+	bool Hit(const Ray& ray, const double t_min, double t_max, IntersectFn&& intersect) const noexcept
+	{
+		return HitLeaves(ray, t_min, t_max, [&](const uint32_t first, const uint32_t count, const double t_lower, double& t_closest)
+		{
+			bool hit_something = false;
+			for (uint32_t p = first; p < first + count; p++)
+				hit_something |= intersect(m_primitives[p], t_lower, t_closest);
+			return hit_something;
+		});
+	}
+
+
+	/* Same as Hit(), but handing whole leaves to the callback, for primitives that are tested in batches.
+		@param intersect  Callable as bool(uint32_t first, uint32_t count, double t_min, double& t_max), which
+		                  tests the primitives referenced by the entries [first, first + count) of the primitive
+		                  indices array and, on a hit, shrinks t_max to the distance of the closest one.
+	*/
+	template <typename IntersectFn>
+	bool HitLeaves(const Ray& ray, const double t_min, double t_max, IntersectFn&& intersect) const noexcept
+	{
+		if (m_nodes.empty())
+			return false;
+
+		const TraversalRay traversal_ray(ray);
+		const bool motion = !m_motion.empty();
+		const float weight = motion ? m_motionInterval.GetWeight(ray.time) : 0.0f;
+
+		uint32_t stack[c_stackSize];
+		uint32_t stack_size = 0;
+		bool hit_something = false;
+
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const uint32_t index = stack[--stack_size];
+			const Node& node = m_nodes[index];
+
+			// With motion, the boxes are interpolated at the time of the ray between the shutter open and close ones.
+			alignas(32) float t_near[N];
+			uint32_t mask = motion
+				? IntersectChildren<true>(node.bounds, m_motion[index].bounds, weight, traversal_ray, float(t_min), float(t_max), t_near)
+				: IntersectChildren<false>(node.bounds, node.bounds, weight, traversal_ray, float(t_min), float(t_max), t_near);
+			if (mask == 0)
+				continue;
+
+			// Sort the children that were hit from the nearest to the farthest.
+			int order[N];
+			int hits = 0;
+			while (mask != 0)
+			{
+				const int i = CountTrailingZeros(mask);
+				mask &= mask - 1;
+
+				int j = hits++;
+				for (; j > 0 && t_near[order[j - 1]] > t_near[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+			}
+
+			// Intersect the leaves right away (nearest first, so that t_max shrinks quickly),
+			// then push the interior children so that the nearest one is popped first.
+			for (int k = 0; k < hits; k++)
+			{
+				const int i = order[k];
+				if (node.IsLeaf(i) && t_near[i] <= t_max)
+					hit_something |= intersect(node.offset[i], uint32_t(node.count[i]), t_min, t_max);
+			}
+
+			for (int k = hits - 1; k >= 0; k--)
+			{
+				const int i = order[k];
+				if (!node.IsLeaf(i))
+					stack[stack_size++] = node.offset[i];
+			}
+		}
+
+		return hit_something;
+	}
+
+private:
+
+	// Recursively collapse the binary sub-tree rooted at the given interior node, returning the index of the wide node.
+	uint32_t Collapse(const std::span<const NodeBVH> binary_nodes, const std::span<const NodeMotionBVH> binary_motion, const uint32_t binary_index)
+	{
+		// Start from the two children of the binary node, then keep opening the interior
+		// child with the largest surface area until all the N slots are filled.
+		uint32_t children[N];
+		int child_count = 0;
+		children[child_count++] = binary_index + 1;
+		children[child_count++] = binary_nodes[binary_index].offset;
+
+		while (child_count < N)
+		{
+			int largest = -1;
+			float largest_area = -1.0f;
+			for (int i = 0; i < child_count; i++)
+			{
+				const NodeBVH& child = binary_nodes[children[i]];
+				if (child.IsLeaf())
+					continue;
+
+				const float area = SurfaceArea(child);
+				if (area > largest_area)
+				{
+					largest_area = area;
+					largest = i;
+				}
+			}
+
+			if (largest < 0)
+				break;
+
+			const uint32_t opened = children[largest];
+			children[largest] = opened + 1;
+			children[child_count++] = binary_nodes[opened].offset;
+		}
+
+		const uint32_t index = AddNode(!binary_motion.empty());
+		SetChildren(binary_nodes, binary_motion, index, children, child_count);
+
+		// Collapse the interior children, which appends their nodes after this one.
+		for (int i = 0; i < child_count; i++)
+		{
+			if (!binary_nodes[children[i]].IsLeaf())
+			{
+				const uint32_t child_index = Collapse(binary_nodes, binary_motion, children[i]);
+				m_nodes[index].offset[i] = child_index;
+			}
+		}
+
+		return index;
+	}
+
+	uint32_t AddNode(const bool motion)
+	{
+		const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+		m_nodes.emplace_back();
+		if (motion)
+			m_motion.emplace_back();
+		return index;
+	}
+
+	void SetChildren(const std::span<const NodeBVH> binary_nodes, const std::span<const NodeMotionBVH> binary_motion,
+		const uint32_t index, const uint32_t* children, const int child_count) noexcept
+	{
+		Node& node = m_nodes[index];
+
+		for (int i = 0; i < N; i++)
+		{
+			if (!binary_motion.empty())
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					m_motion[index].bounds[a][i] = i < child_count ? binary_motion[children[i]].min[a] : 0.0f;
+					m_motion[index].bounds[a + 3][i] = i < child_count ? binary_motion[children[i]].max[a] : 0.0f;
+				}
+			}
+
+			if (i < child_count)
+			{
+				const NodeBVH& child = binary_nodes[children[i]];
+				for (int a = 0; a < 3; a++)
+				{
+					node.bounds[a][i] = child.min[a];
+					node.bounds[a + 3][i] = child.max[a];
+				}
+				node.offset[i] = child.IsLeaf() ? child.offset : 0;
+				node.count[i] = child.count;
+			}
+			else
+			{
+				// Empty slots have inverted bounds, which no ray can ever hit.
+				for (int a = 0; a < 3; a++)
+				{
+					node.bounds[a][i] = std::numeric_limits<float>::infinity();
+					node.bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+				}
+				node.offset[i] = 0;
+				node.count[i] = 0;
+			}
+		}
+	}
+
+	static float SurfaceArea(const NodeBVH& node) noexcept
+	{
+		const float dx = node.max[0] - node.min[0];
+		const float dy = node.max[1] - node.min[1];
+		const float dz = node.max[2] - node.min[2];
+		return 2.0f * (dx * dy + dy * dz + dz * dx);
+	}
+
+	static int CountTrailingZeros(const uint32_t mask) noexcept
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+
+	using Bounds = float[6][N];
+
+	// Test the ray against the bounds of all the children of a node, returning a bit mask of the children
+	// that were hit and writing the distance at which the ray enters each of them.
+	// If Motion is true, the bounds are first moved by the given fraction (weight) of the motion offsets.
+	template <bool Motion>
+	static uint32_t IntersectChildren(const Bounds& bounds, const Bounds& motion, const float weight,
+		const TraversalRay& ray, const float t_min, const float t_max, float* t_near) noexcept
+	{
+#if defined(RT_SIMD_X86)
+		if constexpr (N == 4)
+			return IntersectChildrenSSE<Motion>(bounds, motion, weight, ray, t_min, t_max, t_near);
+		else if constexpr (N == 8)
+			return IntersectChildrenAVX<Motion>(bounds, motion, weight, ray, t_min, t_max, t_near);
+		else
+#endif
+			return IntersectChildrenScalar<Motion>(bounds, motion, weight, ray, t_min, t_max, t_near);
+	}
+
+	template <bool Motion>
+	static uint32_t IntersectChildrenScalar(const Bounds& bounds, const Bounds& motion, const float weight,
+		const TraversalRay& ray, const float t_min, const float t_max, float* t_near) noexcept
+	{
+		const auto plane = [&](const int row, const int i)
+		{
+			if constexpr (Motion)
+				return bounds[row][i] + motion[row][i] * weight;
+			else
+				return bounds[row][i];
+		};
+
+		uint32_t mask = 0;
+		for (int i = 0; i < N; i++)
+		{
+			float t_enter = t_min;
+			float t_exit = t_max;
+			for (int a = 0; a < 3; a++)
+			{
+				const float t0 = (plane(ray.near_plane[a], i) - ray.origin[a]) * ray.inv_direction[a];
+				const float t1 = (plane(ray.far_plane[a], i) - ray.origin[a]) * ray.inv_direction[a];
+				t_enter = t0 > t_enter ? t0 : t_enter;
+				t_exit = t1 < t_exit ? t1 : t_exit;
+			}
+			t_near[i] = t_enter;
+			mask |= uint32_t(t_enter <= t_exit) << i;
+		}
+		return mask;
+	}
+
+#if defined(RT_SIMD_X86)
+	template <bool Motion>
+	static uint32_t IntersectChildrenSSE(const Bounds& bounds, const Bounds& motion, const float weight,
+		const TraversalRay& ray, const float t_min, const float t_max, float* t_near) noexcept
+	{
+		const auto plane = [&](const int row)
+		{
+			if constexpr (Motion)
+				return _mm_add_ps(_mm_load_ps(bounds[row]), _mm_mul_ps(_mm_load_ps(motion[row]), _mm_set1_ps(weight)));
+			else
+				return _mm_load_ps(bounds[row]);
+		};
+
+		__m128 t_enter = _mm_set1_ps(t_min);
+		__m128 t_exit = _mm_set1_ps(t_max);
+
+		for (int a = 0; a < 3; a++)
+		{
+			const __m128 origin = _mm_set1_ps(ray.origin[a]);
+			const __m128 inv_direction = _mm_set1_ps(ray.inv_direction[a]);
+			const __m128 t0 = _mm_mul_ps(_mm_sub_ps(plane(ray.near_plane[a]), origin), inv_direction);
+			const __m128 t1 = _mm_mul_ps(_mm_sub_ps(plane(ray.far_plane[a]), origin), inv_direction);
+
+			// The min/max instructions return the second operand if either one is NaN (0 * inf),
+			// which happens when the ray origin lies on a slab plane parallel to the ray.
+			t_enter = _mm_max_ps(t0, t_enter);
+			t_exit = _mm_min_ps(t1, t_exit);
+		}
+
+		_mm_store_ps(t_near, t_enter);
+		return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+	}
+
+	template <bool Motion>
+	RT_TARGET_AVX static uint32_t IntersectChildrenAVX(const Bounds& bounds, const Bounds& motion, const float weight,
+		const TraversalRay& ray, const float t_min, const float t_max, float* t_near) noexcept
+	{
+		const auto plane = [&](const int row) RT_TARGET_AVX
+		{
+			if constexpr (Motion)
+				return _mm256_add_ps(_mm256_load_ps(bounds[row]), _mm256_mul_ps(_mm256_load_ps(motion[row]), _mm256_set1_ps(weight)));
+			else
+				return _mm256_load_ps(bounds[row]);
+		};
+
+		__m256 t_enter = _mm256_set1_ps(t_min);
+		__m256 t_exit = _mm256_set1_ps(t_max);
+
+		for (int a = 0; a < 3; a++)
+		{
+			const __m256 origin = _mm256_set1_ps(ray.origin[a]);
+			const __m256 inv_direction = _mm256_set1_ps(ray.inv_direction[a]);
+			const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(plane(ray.near_plane[a]), origin), inv_direction);
+			const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(plane(ray.far_plane[a]), origin), inv_direction);
+
+			t_enter = _mm256_max_ps(t0, t_enter);
+			t_exit = _mm256_min_ps(t1, t_exit);
+		}
+
+		_mm256_store_ps(t_near, t_enter);
+		return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)));
+	}
+#endif
+};
+
+
+// Binary BVH together with the wide hierarchy collapsed from it, which is traversed instead when the requested
+// width (or, by default, the widest one supported by the CPU) is 4 or 8. The scene and the objects that have
+// their own hierarchy all go through it, so that the width option applies to every level.
+class TraversalBVH
+{
+private:
+
+	BVH        m_bvh;
+	WideBVH<4> m_bvh4;
+	WideBVH<8> m_bvh8;
+	uint32_t   m_width = 2;		// Which of the hierarchies above is used for traversal
+
+public:
+
+	BVH&       GetBVH()       noexcept { return m_bvh; }
+	const BVH& GetBVH() const noexcept { return m_bvh; }
+
+	uint32_t GetWidth() const noexcept { return m_width; }
+
+
+	// Collapse the binary hierarchy into one of the given width, which can be traversed faster using SIMD
+	// instructions: 8-wide nodes need AVX, while SSE is enough for 4-wide ones. This is a single linear pass,
+	// so it is simply redone whenever the binary hierarchy changes.
+	void Collapse(const uint32_t width)
+	{
+		m_width = SelectWidth(width);
+		m_bvh4 = WideBVH<4>();
+		m_bvh8 = WideBVH<8>();
+
+		if (m_width == 8)
+			m_bvh8.Build(m_bvh);
+		else if (m_width == 4)
+			m_bvh4.Build(m_bvh);
+	}
+
+
+	// Find the closest intersection between a ray and the primitives in the hierarchy, as BVH::Hit() does.
+	template <typename IntersectFn>
+	bool Hit(const Ray& ray, const double t_min, const double t_max, IntersectFn&& intersect) const noexcept
+	{
+		switch (m_width)
+		{
+			case 8:  return m_bvh8.Hit(ray, t_min, t_max, intersect);
+			case 4:  return m_bvh4.Hit(ray, t_min, t_max, intersect);
+			default: return m_bvh.Hit(ray, t_min, t_max, intersect);
+		}
+	}
+
+	// Same as Hit(), but handing whole leaves to the callback, as BVH::HitLeaves() does.
+	template <typename IntersectFn>
+	bool HitLeaves(const Ray& ray, const double t_min, const double t_max, IntersectFn&& intersect) const noexcept
+	{
+		switch (m_width)
+		{
+			case 8:  return m_bvh8.HitLeaves(ray, t_min, t_max, intersect);
+			case 4:  return m_bvh4.HitLeaves(ray, t_min, t_max, intersect);
+			default: return m_bvh.HitLeaves(ray, t_min, t_max, intersect);
+		}
+	}
+
+
+	// Width actually used for the requested one: 0 picks the widest one supported by the CPU, and
+	// 8 falls back to 4 without AVX (with a warning, given only once for all the hierarchies).
+	static uint32_t SelectWidth(const uint32_t width)
+	{
+		if (width == 0)
+			return CpuFeatures::HasAVX() ? 8 : 4;
+
+		if (width == 8 && !CpuFeatures::HasAVX())
+		{
+			static std::once_flag warning;
+			std::call_once(warning, []() { std::cerr << "WARNING: the CPU does not support AVX instructions, falling back to a 4-wide BVH.\n"; });
+			return 4;
+		}
+
+		return width == 8 || width == 4 ? width : 2;
+	}
+};
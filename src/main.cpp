@@ -3,6 +3,7 @@
 #include <chrono>
 
 #include "Common.h"
+#include "Checkpoint.h"
 #include "Image.h"
 #include "JsonDeserializer.h"
 #include "RenderSettings.h"
@@ -10,6 +11,21 @@
 #include "Scene.h"
 
 
+// Inserts the frame number before the extension of the output path (e.g. render.ppm -> render_0001.ppm).
+static std::string GetFramePath(const std::string& path, const uint32_t frame)
+{
+    std::string number = std::to_string(frame);
+    number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+
+    const size_t dot = path.find_last_of('.');
+    const size_t separator = path.find_last_of("/\\");
+    if (dot == std::string::npos || (separator != std::string::npos && dot < separator))
+        return path + '_' + number;
+
+    return path.substr(0, dot) + '_' + number + path.substr(dot);
+}
+
+
 int main(int argc, const char** argv)
 {
     // PARSE ARGUMENTS
@@ -24,7 +40,10 @@ int main(int argc, const char** argv)
     {
         std::cerr << "ERROR: " << e.what() << '\n' 
             << "Usage: " << argv[0] << " <scene> <output> <width> <height> "                    // Required parameters
-            << "[-s / --samples <value>] [-b / --bounces <value>] [-t / --threads <value>]"     // Optional parameters
+            << "[-s / --samples <value>] [--min-samples <value>] [--noise-threshold <value>] [--heatmap <path>] [--target-spp <value>] [--pass-samples <value>] [--time-limit <seconds>] [--checkpoint <path>] [--checkpoint-interval <seconds>] [--resume <path>] [-b / --bounces <value>] [--rr-depth <value>] [--sampler <random|stratified|sobol|bluenoise>] [-t / --threads <value>] "    // Optional parameters
+            << "[--random-streams <thread|pixel>] [--tile-size <value>] [--tile-order <scanline|morton|spiral>] [--bvh-leaf-size <value>] [--bvh-width <2|4|8>] [--build-threads <value>] "
+            << "[--bvh-builder <sah|lbvh>] [--bvh-treelet-passes <value>] [--bvh-rebuild-threshold <value>] [--frames <value>] "
+            << "[--bvh-cache <directory|off>]"
             << std::endl;
 
         return -1;
@@ -45,28 +64,153 @@ int main(int argc, const char** argv)
 
     // BUILD BVH STRUCTURE
 
-    scene.BuildBVH(scene.camera.GetTimeShutterOpen(), scene.camera.GetTimeShutterClose());
+    BuildOptionsBVH bvh_options;
+    bvh_options.max_leaf_size = settings.BVHLeafSize();
+    bvh_options.width = settings.BVHWidth();
+    bvh_options.thread_count = settings.BuildThreadCount();
+    bvh_options.builder = settings.GetBVHBuilder();
+    bvh_options.treelet_passes = settings.BVHTreeletPasses();
+    bvh_options.rebuild_threshold = settings.BVHRebuildThreshold();
+
+    const auto build_start_time = std::chrono::steady_clock::now();
+
+    // Reuse the BVH built by a previous run for the same scene, if any: the cache file is mapped
+    // in memory and used as it is, so loading it takes almost no time even for huge scenes.
+    const double shutter_open_time = scene.camera.GetTimeShutterOpen();
+    const double shutter_close_time = scene.camera.GetTimeShutterClose();
+    const std::string cache_path = settings.BVHCachePath();
+    uint64_t cache_key = 0;
+    bool cache_hit = false;
+
+    if (!cache_path.empty())
+    {
+        try
+        {
+            cache_key = BVHCache::ComputeKey(settings.ScenePath(), scene.files, shutter_open_time, shutter_close_time, bvh_options);
+            cache_hit = scene.LoadBVH(cache_path, cache_key, bvh_options);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "WARNING: BVH cache not available, " << e.what() << "\n";
+        }
+    }
 
-    // RENDER IMAGE
+    if (!cache_hit)
+    {
+        scene.BuildBVH(shutter_open_time, shutter_close_time, bvh_options);
+
+        if (!cache_path.empty())
+        {
+            try
+            {
+                BVHCache::Save(cache_path, cache_key, scene.bvh.GetBVH());
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "WARNING: " << e.what() << " '" << cache_path << "'\n";
+            }
+        }
+    }
 
-    const auto start_time = std::chrono::steady_clock::now();
+    const auto build_end_time = std::chrono::steady_clock::now();
+    const auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(build_end_time - build_start_time).count();
 
-    Image image(settings.ImageWidth(), settings.ImageHeight());
+    // The hierarchies within the objects (meshes, sphere sets, prototypes) were built while loading the scene.
+    const BVHCache::ObjectStatistics& object_statistics = BVHCache::GetObjectStatistics();
+    std::cout << "BVH " << (cache_hit ? "loaded from cache" : "built") << " over " << scene.objects.size() << " objects with "
+        << scene.bvh.GetBVH().GetNodes().size() << " nodes";
+    if (object_statistics.built + object_statistics.loaded > 0)
+        std::cout << ", object BVHs " << object_statistics.built << " built and " << object_statistics.loaded << " loaded from cache";
+    std::cout << " (" << (build_duration / 1000.0 + object_statistics.seconds * 1000.0) << "ms)\n";
 
-    Renderer::Render(scene, image, settings);
+    // RENDER IMAGE(S)
 
-    // FINISH
+    const auto start_time = std::chrono::steady_clock::now();
 
-    try
-    {
-        image.WriteToDisk(settings.OutputPath());
-    }
-    catch (const std::exception& e)
+    // Animations move the shutter window forward by its own length at every frame, so that
+    // consecutive frames cover contiguous time intervals (and the motion blur joins seamlessly).
+    const double shutter_length = shutter_close_time - shutter_open_time;
+
+    for (uint32_t frame = 0; frame < settings.FrameCount(); frame++)
     {
-        std::cerr << "ERROR: " << e.what() << "\n";
-        return -1;
+        if (frame > 0)
+        {
+            const double frame_open = shutter_open_time + frame * shutter_length;
+            const double frame_close = frame_open + shutter_length;
+            scene.camera.SetShutter(frame_open, frame_close);
+
+            const auto refit_start_time = std::chrono::steady_clock::now();
+
+            const bool rebuilt = scene.RefitBVH(frame_open, frame_close, bvh_options);
+
+            const auto refit_end_time = std::chrono::steady_clock::now();
+            const auto refit_duration = std::chrono::duration_cast<std::chrono::microseconds>(refit_end_time - refit_start_time).count();
+
+            std::cout << "\nFrame " << frame << ": BVH " << (rebuilt ? "rebuilt" : "refitted")
+                << ", SAH cost " << scene.bvh.GetBVH().Cost() << " (" << (refit_duration / 1000.0) << "ms)\n";
+        }
+
+        Framebuffer framebuffer(settings.ImageWidth(), settings.ImageHeight());
+
+        // Continue from the checkpoint of a previous run, if there is one: a missing file only means that the
+        // render (or this frame of the animation) had not started yet, but one that cannot be used is an error,
+        // rather than something to overwrite silently.
+        std::unique_ptr<CheckpointWriter> checkpoints;
+        try
+        {
+            const std::string checkpoint_path = settings.CheckpointPath();
+            const std::string resume_path = settings.ResumePath();
+
+            if (!checkpoint_path.empty())
+            {
+                const uint64_t checkpoint_key = Checkpoint::ComputeKey(settings, scene.files, scene.camera.GetTimeShutterOpen(), scene.camera.GetTimeShutterClose());
+                const Checkpoint::StopCriteria stop_criteria(settings);
+
+                const std::string frame_resume_path = settings.FrameCount() > 1 ? GetFramePath(resume_path, frame) : resume_path;
+                if (!resume_path.empty() && std::filesystem::exists(frame_resume_path))
+                {
+                    Checkpoint::Load(frame_resume_path, checkpoint_key, stop_criteria, framebuffer);
+                    std::cout << "Resuming from pass " << framebuffer.GetPassCount() << " of '" << frame_resume_path << "'\n";
+                }
+                else if (!resume_path.empty())
+                {
+                    std::cerr << "WARNING: checkpoint file '" << frame_resume_path << "' not found, starting from scratch\n";
+                }
+
+                checkpoints = std::make_unique<CheckpointWriter>(
+                    settings.FrameCount() > 1 ? GetFramePath(checkpoint_path, frame) : checkpoint_path, checkpoint_key, stop_criteria);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERROR: " << e.what() << "\n";
+            return -1;
+        }
+
+        Renderer::Render(scene, framebuffer, settings, checkpoints.get());
+
+        try
+        {
+            Image image(settings.ImageWidth(), settings.ImageHeight());
+            framebuffer.Resolve(image);
+            image.WriteToDisk(settings.FrameCount() > 1 ? GetFramePath(settings.OutputPath(), frame) : settings.OutputPath());
+
+            if (!settings.HeatmapPath().empty())
+            {
+                Image heatmap(settings.ImageWidth(), settings.ImageHeight());
+                framebuffer.ResolveHeatmap(heatmap, settings.SampleTarget());
+                heatmap.WriteToDisk(settings.FrameCount() > 1 ? GetFramePath(settings.HeatmapPath(), frame) : settings.HeatmapPath());
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERROR: " << e.what() << "\n";
+            return -1;
+        }
     }
 
+    // FINISH
+
     const auto end_time = std::chrono::steady_clock::now();
     const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
 